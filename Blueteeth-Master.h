@@ -11,8 +11,32 @@
 #include <BLEUtils.h>
 #include <BLEScan.h>
 #include <BLEAdvertisedDevice.h>
+#include <esp_bt.h>
+#include <esp_gap_bt_api.h>
 #include "bluetooth_scanning.h"
 
+#include "static_allocation.h"
+#include "boot.h"
+#include "console.h"
+#include "jobs.h"
+#include "bench.h"
+#include "logging.h"
+#include "metrics.h"
+#include "tracing.h"
+#include "memory_profiling.h"
+#include "packet_types.h"
+#include "packet_pool.h"
+#include "packet_queue.h"
+#include "packet_dispatch.h"
+#include "slave_table.h"
+#include "data_plane_routing.h"
+#include "flow_control.h"
+#include "stream_buffer.h"
+#include "stream_controller.h"
+#include "power.h"
+#include "latency.h"
+#include "fast_reconnect.h"
+
 #include "terminal.h"
 #include "AudioSamples.h"
 #include <BlueteethInternalNetworkStack.h>
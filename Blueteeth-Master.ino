@@ -1,48 +1,126 @@
 #include "Blueteeth-Master.h"
 
-int scanTime = 5; //In seconds
 char input_buffer[MAX_BUFFER_SIZE];
-BLEScan* pBLEScan;
-SemaphoreHandle_t uartMutex;
 TaskHandle_t terminalInputTaskHandle;
 TaskHandle_t ringTokenWatchdogTaskHandle;
+TaskHandle_t packetIntakeTaskHandle;
 TaskHandle_t packetReceptionTaskHandle;
 TaskHandle_t dataStreamPackagerTaskHandle;
+TaskHandle_t consoleWriterTaskHandle;
+TaskHandle_t jobWorkerTaskHandles[JOB_WORKERS];
 
 void terminalInputTask ( void * );
 void ringTokenWatchdogTask( void * );
+void packetIntakeTask( void * );
 void packetReceptionTask( void * );
 void dataStreamPackagerTask( void * );
-void dataStreamMonitorTask( void * );
+void consoleWriterTask( void * );
+void jobWorkerTask( void * );
+void performAction(PacketType action, job_t * job);
 
 terminalParameters_t terminalParameters;
-int discoveryIdx;
+uint8_t commandIndex[COMMAND_INDEX_SIZE];
+bleScanCache_t bleScanCache;
+fastReconnect_t fastReconnect;
+bootProfile_t bootProfile;
+powerManager_t powerManager;
+slaveTable_t slaveTable;
+routingTable_t routingTable;
+flowControl_t flowControl;
+streamBuffer_t streamBuffer;
+streamController_t streamController;
+logRing_t logRings[portNUM_PROCESSORS];
+TaskHandle_t logWriter = NULL;
+console_t console;
+jobRunner_t jobRunner;
+benchScript_t benchScript;
+metrics_t metrics;
+traceRing_t traceRing;
+latencyTracker_t latencyTracker;
+memoryProfile_t memoryProfile;
+packetPool_t packetPool;
+packetQueue_t packetQueue;
+packetDispatch_t packetDispatch;
+volatile bool heapLocked = false;
+thread_local uint8_t heapExemptDepth = 0;
+thread_local bool consoleInteractive = false;
+thread_local blockPool_t * activeBlockPool = NULL;
+blockPool_t stagingPool = BLOCK_POOL_INITIALIZER;
+#if STATIC_ALLOCATION
+StackType_t staticTaskStacks[MAX_STATIC_TASKS][TASK_STACK_SIZE];
+StaticTask_t staticTaskBuffers[MAX_STATIC_TASKS];
+uint32_t staticTasksUsed = 0;
+portMUX_TYPE staticTasksLock = portMUX_INITIALIZER_UNLOCKED;
+#endif
 
 BluetoothA2DPSink a2dpSink;
 
-BlueteethMasterStack internalNetworkStack(10, &packetReceptionTaskHandle, &Serial2, &Serial1); //Serial1 = Data Plane, Serial2 = Control Plane
+BlueteethMasterStack internalNetworkStack(10, &packetIntakeTaskHandle, &Serial2, &Serial1); //Serial1 = Data Plane, Serial2 = Control Plane
 BlueteethBaseStack * internalNetworkStackPtr = &internalNetworkStack; //Need pointer for run-time polymorphism
 
-volatile bool streamActive;
-
 /*  Callback for when data is received from A2DP BT stream
 *   
 *   @data - Pointer to an array with the individual bytes received.
 *   @length - The number of bytes received.
 */ 
 void a2dpSinkDataReceived(const uint8_t *data, uint32_t length){
-  // Serial.print("BLUETOOTH DATA RECEIVED!");
-  
-  internalNetworkStack.recordDataBufferAccessTime();
-
-  for (int i = 0; i < length; i++){
-    internalNetworkStack.dataBuffer.push_back(data[i]);
+  TRACE_SPAN("ingest");
+  static bool profiled = false;
+  if (!profiled){ //the callback runs in a BT stack task we don't create, so register it on first use
+    memoryRegisterTask(xTaskGetCurrentTaskHandle(), SUBSYSTEM_A2DP);
+    profiled = true;
   }
-
-  if (streamActive == false){
-    vTaskResume(dataStreamPackagerTaskHandle);
-    streamActive = true;
+  LOG_DEBUG("A2DP data received (%u bytes)", length);
+  metricsCount(COUNTER_A2DP_CALLBACKS);
+  metricsCount(COUNTER_A2DP_BYTES, length);
+  metricsRecord(HISTOGRAM_A2DP_CALLBACK_BYTES, length);
+
+  size_t written;
+  size_t depth;
+  xSemaphoreTake(internalNetworkStack.dataBufferMutex, portMAX_DELAY); //the packager may be releasing or consuming the buffer
+  {
+    HEAP_EXEMPT(); //dataBuffer is the stack's deque, which allocates blocks as it grows
+    written = streamBufferWrite(streamBuffer, internalNetworkStack.dataBuffer, data, length);
   }
+  depth = internalNetworkStack.dataBuffer.size();
+  latencyRecordArrival(latencyTracker, written);
+  xSemaphoreGive(internalNetworkStack.dataBufferMutex);
+  streamControllerDataReceived(streamController, written, depth);
+}
+
+/*  Callback for when the A2DP source starts, pauses or stops audio
+*
+*   @state - the new audio state
+*   @obj - unused
+*/
+void a2dpAudioStateChanged(esp_a2d_audio_state_t state, void * obj){
+  if (state != ESP_A2D_AUDIO_STATE_STARTED) streamControllerRequestDrain(streamController);
+}
+
+/*  Callback for when the A2DP source connects or disconnects
+*
+*   @state - the new connection state
+*   @obj - unused
+*/
+void a2dpConnectionStateChanged(esp_a2d_connection_state_t state, void * obj){
+  bleScanSourceState(state != ESP_A2D_CONNECTION_STATE_DISCONNECTED);
+  if (state == ESP_A2D_CONNECTION_STATE_CONNECTED) fastReconnectA2dpConnected(*a2dpSink.get_current_peer_address());
+}
+
+/*  Callback for when the A2DP source's codec configuration sets the sample rate
+*
+*   @rate - sample rate in Hz
+*/
+void a2dpSampleRateChanged(uint16_t rate){
+  flowControlSetSampleRate(flowControl, rate);
+  fastReconnectSampleRate(rate);
+}
+
+/*  Callback for when the UART driver has moved received console bytes into its buffer
+*
+*/
+void terminalDataReceived(){
+  xTaskNotifyGive(terminalInputTaskHandle);
 }
 
 void read_data_stream(const uint8_t *data, uint32_t length) {
@@ -50,58 +128,182 @@ void read_data_stream(const uint8_t *data, uint32_t length) {
     int16_t *values = (int16_t*) data;
     for (int j=0; j<length/2; j+=2){
       // print the 2 channel values
-      Serial.print(values[j]);
-      Serial.print(",");
-      Serial.println(values[j+1]);
+      consolePrintf("%d,%d\n\r", values[j], values[j+1]);
     }
 }
 
-void setup() {
-  
-  //Start Serial comms
-  Serial.begin(115200);
-  uartMutex = xSemaphoreCreateMutex(); //mutex for UART
+/*  Start-up steps, run by bootRun() across both cores
+*
+*/
+void bootRuntime(){
+  consoleInit();
+  logInit();
+  initSlaveTable(slaveTable);
+  build_command_index();
+  packetPoolInit();
+  packetQueueInit();
+  jobRunnerInit();
+  bleScanInit();
+  powerInit();
+  traceRing.enabled = true;
+  memoryResetPeaks();
+}
 
-  internalNetworkStack.begin();
-  
-  //Setup Peripherals
-  // pBLEScan = bleScanSetup();
-  
-  xTaskCreate(dataStreamPackagerTask, // Task function
-  "DATA STREAM PACKAGER", // Task name
+void bootConsoleTasks(){
+  createTask(consoleWriterTask, // Task function
+  "CONSOLE WRITER", // Task name
   4096, // Stack depth 
   NULL, 
-  24, // Priority
-  &dataStreamPackagerTaskHandle); // Task handler
-  
-  //Create tasks
-  xTaskCreate(terminalInputTask, // Task function
+  1, // Priority
+  &consoleWriterTaskHandle); // Task handler
+  console.writer = consoleWriterTaskHandle;
+  logWriter = consoleWriterTaskHandle;
+
+  createTask(terminalInputTask, // Task function
   "UART TERMINAL INPUT", // Task name
   4096, // Stack depth
   NULL, 
   1, // Priority
   &terminalInputTaskHandle); // Task handler
-  
-  xTaskCreate(ringTokenWatchdogTask, // Task function
+  Serial.setRxTimeout(1); //report bytes after one idle symbol (~90 us) instead of the default ~10
+  Serial.onReceive(terminalDataReceived);
+
+  for (int worker = 0; worker < JOB_WORKERS; worker++){
+    createTask(jobWorkerTask, // Task function
+    "JOB WORKER", // Task name
+    4096, // Stack depth 
+    NULL, 
+    1, // Priority
+    &jobWorkerTaskHandles[worker]); // Task handler
+  }
+
+  memoryRegisterTask(consoleWriterTaskHandle, SUBSYSTEM_CONSOLE);
+  memoryRegisterTask(terminalInputTaskHandle, SUBSYSTEM_TERMINAL);
+  for (int worker = 0; worker < JOB_WORKERS; worker++) memoryRegisterTask(jobWorkerTaskHandles[worker], SUBSYSTEM_JOBS);
+}
+
+void bootStream(){
+  resetRoutingTable(routingTable);
+  initFlowControl(flowControl);
+  latencyInit(latencyTracker);
+  streamBufferInit(streamBuffer);
+  streamControllerInit(streamController, NULL); //before the packager runs, it reads the controller straight away
+
+  createTask(dataStreamPackagerTask, // Task function
+  "DATA STREAM PACKAGER", // Task name
+  4096, // Stack depth 
+  NULL, 
+  24, // Priority
+  &dataStreamPackagerTaskHandle); // Task handler
+  portENTER_CRITICAL(&streamController.lock);
+  streamController.packager = dataStreamPackagerTaskHandle;
+  portEXIT_CRITICAL(&streamController.lock);
+  memoryRegisterTask(dataStreamPackagerTaskHandle, SUBSYSTEM_STREAM);
+}
+
+void bootNetworkStack(){
+  internalNetworkStack.begin();
+
+  createTask(ringTokenWatchdogTask, // Task function
   "RING TOKEN WATCHDOG", // Task name
   4096, // Stack depth 
   NULL, 
   1, // Priority
   &ringTokenWatchdogTaskHandle); // Task handler
 
-  xTaskCreate(packetReceptionTask, // Task function
+  createTask(packetIntakeTask, // Task function
+  "PACKET INTAKE", // Task name
+  2048, // Stack depth 
+  NULL, 
+  23, // Priority (above the network stack's tasks so it's suspended again before the next resume)
+  &packetIntakeTaskHandle); // Task handler
+
+  createTask(packetReceptionTask, // Task function
   "PACKET RECEPTION HANDLER", // Task name
   4096, // Stack depth 
   NULL, 
   1, // Priority
   &packetReceptionTaskHandle); // Task handler
 
+  memoryRegisterTask(ringTokenWatchdogTaskHandle, SUBSYSTEM_CONTROL_PLANE);
+  memoryRegisterTask(packetIntakeTaskHandle, SUBSYSTEM_CONTROL_PLANE);
+  memoryRegisterTask(packetReceptionTaskHandle, SUBSYSTEM_CONTROL_PLANE);
+}
+
+void bootRingHandshake(){
+  performAction(INITIALIZAITON, NULL); //the slaves are connected as soon as the ring matches the saved topology
+}
+
+void bootBluetooth(){
+  flowControlSetSampleRate(flowControl, fastReconnect.saved.a2dpSampleRate); //pace at the last source's rate until it negotiates again
   a2dpSink.set_stream_reader(a2dpSinkDataReceived);
-  a2dpSink.set_auto_reconnect(false);
+  a2dpSink.set_on_audio_state_changed(a2dpAudioStateChanged);
+  a2dpSink.set_on_connection_state_changed(a2dpConnectionStateChanged);
+  a2dpSink.set_sample_rate_callback(a2dpSampleRateChanged);
+  a2dpSink.set_auto_reconnect(true); //the library keeps the last source in NVS and reconnects to it on start
   a2dpSink.start("Blueteeth Sink"); //Begin advertising
 }
 
+/*  Shuts BLE down after a scan so streaming doesn't carry its memory. BLE shares Bluedroid and the controller with A2DP,
+*   so both come down (BLEDevice::deinit takes the controller with it) and the controller and A2DP are started again; that's
+*   only done while no source is connecting or connected. Runs on setup()'s task (from loop()), which has the stack A2DP's start needs.
+*
+*/
+void bleRelease(){
+  if (!bleScanReleaseWanted()) return;
+  if (bleScanCache.sourceBusy){
+    consolePrint("BLE stays up while an A2DP source is connected, it goes down when the source disconnects\n\r");
+    return;
+  }
+  esp_bt_gap_set_scan_mode(ESP_BT_NON_CONNECTABLE, ESP_BT_NON_DISCOVERABLE); //so no source can connect between the check and end()
+  vTaskDelay(BLE_RELEASE_SETTLE_MS); //a connection already being paged reports itself meanwhile
+  if (!bleScanBeginRelease()){
+    esp_bt_gap_set_scan_mode(ESP_BT_CONNECTABLE, ESP_BT_GENERAL_DISCOVERABLE);
+    return;
+  }
+  bool bleUp = (bleScanCache.scan != NULL);
+  HEAP_EXEMPT(); //bringing A2DP back up allocates its host state again
+  a2dpSink.end(false); //false keeps the controller up, A2DP's own release frees classic BT memory too and can't be undone
+  if (bleUp) BLEDevice::deinit(false); //disables and deinitializes the controller whatever the flag (false only keeps its memory), and lets BLEDevice::init run in full next time
+  if (bleScanCache.releaseController && !bleScanCache.controllerReleased){
+    btStop(); //the controller's memory can only be released while it's uninitialized
+    bleScanCache.controllerReleased = (esp_bt_controller_mem_release(ESP_BT_MODE_BLE) == ESP_OK);
+  }
+  bool controllerUp = bleScanCache.controllerReleased ? btStartMode(BT_MODE_CLASSIC_BT) : btStart(); //A2DP's start needs it enabled again, without BLE once that's released
+  if (controllerUp) bootBluetooth();
+  else LOG_ERROR("Bluetooth controller didn't restart, A2DP stays down");
+  bleScanEndRelease();
+}
+
+//Indexes into bootSteps, for dependencies
+enum { BOOT_RUNTIME, BOOT_NVS, BOOT_CONSOLE_TASKS, BOOT_NETWORK_STACK, BOOT_STREAM, BOOT_RING_HANDSHAKE, BOOT_BLUETOOTH };
+
+//Bluetooth bring-up is the slowest step, so the ring handshake (and everything it needs) runs on the other core meanwhile
+const bootStep_t bootSteps[] = {
+  {"runtime", bootRuntime, 0, BOOT_ANY_CORE},
+  {"nvs", fastReconnectInit, BOOT_STEP(BOOT_RUNTIME), BOOT_ANY_CORE},
+  {"console tasks", bootConsoleTasks, BOOT_STEP(BOOT_RUNTIME), BOOT_ANY_CORE},
+  {"network stack", bootNetworkStack, BOOT_STEP(BOOT_RUNTIME), BOOT_ANY_CORE},
+  {"stream", bootStream, BOOT_STEP(BOOT_NETWORK_STACK), BOOT_ANY_CORE}, //the packager takes the stack's dataBufferMutex
+  {"ring handshake", bootRingHandshake, BOOT_STEP(BOOT_NETWORK_STACK) | BOOT_STEP(BOOT_STREAM) | BOOT_STEP(BOOT_NVS), BOOT_ANY_CORE}, //CONNECT starts the stream
+  {"bluetooth", bootBluetooth, BOOT_STEP(BOOT_STREAM) | BOOT_STEP(BOOT_NETWORK_STACK) | BOOT_STEP(BOOT_NVS), ARDUINO_RUNNING_CORE}, //setup()'s core, the A2DP start needs more stack than the helper has
+};
+
+void setup() {
+
+  bootProfile.setupStartUs = micros();
+  Serial.begin(115200);
+  memoryCheckBuildFlags();
+  bootRun(bootSteps, sizeof(bootSteps) / sizeof(bootSteps[0]));
+  printBootReport();
+  bleScanCache.releaser = xTaskGetCurrentTaskHandle(); //loop() shuts BLE down when asked
+
+  heapLocked = true; //anything the sketch's tasks allocate from here on trips heapCheckAllocation in static builds
+}
+
 void loop() {
+  ulTaskNotifyTake(pdTRUE, portMAX_DELAY); //woken by bleScanRequestRelease()
+  bleRelease();
 }
 
 
@@ -110,97 +312,322 @@ void loop() {
 */  
 void ringTokenWatchdogTask(void * params) {
   while (1){
-    vTaskDelay(RING_TOKEN_GENERATION_DELAY_MS);
+    vTaskDelay(powerScaledPeriod(RING_TOKEN_GENERATION_DELAY_MS)); //checks less often while idle, a lost token or packet just waits longer
     if (internalNetworkStack.getTokenRxFlag() == false){
-      Serial.print("Generating a new token.\n\r"); //DEBUG STATEMENT
+      TRACE_SPAN("token");
+      LOG_DEBUG("Generating a new token.");
+      metricsCount(COUNTER_TOKENS_GENERATED);
       // internalNetworkStack.tokenReceived();
       internalNetworkStack.generateNewToken();
     }
+    else metricsCount(COUNTER_TOKEN_PERIODS);
     internalNetworkStack.resetTokenRxFlag(); 
+    vTaskResume(packetIntakeTaskHandle); //picks up a packet whose resume came in just before the intake task suspended
+    memorySampleFreeHeap();
+  }
+}
+
+/*  Packs data into frames and puts them on the data plane
+*
+*   @tmp - scratch space for the packed frames
+*   @dataLen - number of bytes to take from the front of @source (a multiple of PAYLOAD_SIZE, see padFrame())
+*   @source - buffer holding the frame header and samples
+*/
+inline void packAndStream(uint8_t * tmp, size_t dataLen, std::deque<uint8_t> & source){
+  size_t frameLen = dataLen / PAYLOAD_SIZE * FRAME_SIZE;
+  {
+    TRACE_SPAN("pack");
+    packDataStream(tmp, dataLen, source);
+  }
+  {
+    TRACE_SPAN("stream");
+    internalNetworkStack.streamData(tmp, frameLen);
   }
+  metricsCount(COUNTER_BYTES_STREAMED, frameLen);
 }
 
 void dataStreamPackagerTask(void * params) {
 
   uint8_t tmp[MAX_DATA_PLANE_PAYLOAD_SIZE / PAYLOAD_SIZE * FRAME_SIZE]; //temporary storage
-  size_t dataLen;
-  size_t frameLen;
+  uint8_t header[MAX_DATA_PLANE_HEADER_SIZE];
+  static slaveTable_t slaves; //copy of slaveTable, refreshed whenever enumeration changes it (static, tmp already fills most of the stack)
+  static uint8_t samples[MAX_DATA_PLANE_PAYLOAD_SIZE]; //the burst's samples, copied out so dataBufferMutex isn't held while the UART sends
+  std::deque<uint8_t> staging; //frames are assembled (and padded) here so dataBuffer only ever holds samples, its blocks come from stagingPool
+  size_t sampleLen;
+  size_t headerLen;
+  bool broadcast;
+  bool starved = false;
+  TickType_t waitTicks;
+  int64_t burstStart;
+  int latencyTag;
+
+  xSemaphoreTake(internalNetworkStack.dataBufferMutex, portMAX_DELAY);
 
   while (1){
 
-    if (internalNetworkStack.dataBuffer.size() < 512) { 
-      xSemaphoreGive(internalNetworkStack.dataBufferMutex); //give away mutex before suspending
-      streamActive = false;
-      vTaskSuspend(NULL);
-      xSemaphoreTake(internalNetworkStack.dataBufferMutex, portMAX_DELAY); //take it back after coming out of suspension
+    latencyConsume(latencyTracker, streamBufferService(streamBuffer, internalNetworkStack.dataBuffer));
+    metricsGauge(GAUGE_BUFFER_DEPTH, internalNetworkStack.dataBuffer.size());
+    metricsGauge(GAUGE_DROPPED_BYTES, streamBuffer.droppedBytes);
+    metricsGauge(GAUGE_OVERFLOW_EVENTS, streamBuffer.overflowEvents);
+    metricsGauge(GAUGE_CREDIT_STARVATION, flowControl.starvationCount);
+    metricsGauge(GAUGE_STREAM_STATE, streamController.state);
+    powerStreamState(streamController.state);
+
+    if (!streamControllerReady(streamController, internalNetworkStack.dataBuffer, waitTicks)) { 
+      if (streamController.state == STREAM_IDLE){
+        latencyResync(latencyTracker); //any partial sample left over was discarded with the buffer
+        powerStreamState(STREAM_IDLE); //drop to the idle setting before blocking, there may be nothing to wake us for a while
+      }
+      xSemaphoreGive(internalNetworkStack.dataBufferMutex); //give away mutex before blocking
+      ulTaskNotifyTake(pdTRUE, waitTicks); //notifications can't be lost the way a resume before a suspend can
+      xSemaphoreTake(internalNetworkStack.dataBufferMutex, portMAX_DELAY); //take it back after waking up
+      continue;
     }
 
-    dataLen = min((internalNetworkStack.dataBuffer.size() / PAYLOAD_SIZE) * PAYLOAD_SIZE, (size_t) MAX_DATA_PLANE_PAYLOAD_SIZE); 
-    frameLen = ceil( (double) dataLen / PAYLOAD_SIZE * FRAME_SIZE);
+    //Leave room for the largest header and keep whole stereo samples so slaves can pick channels out of the frame
+    sampleLen = min(internalNetworkStack.dataBuffer.size(), (size_t) (MAX_DATA_PLANE_PAYLOAD_SIZE - MAX_DATA_PLANE_HEADER_SIZE - MAX_DATA_PLANE_PADDING));
+    sampleLen = (sampleLen / STEREO_FRAME_BYTES) * STEREO_FRAME_BYTES;
+    slaveTableRefresh(slaveTable, slaves);
+    sampleLen = creditLimitedLength(flowControl, routingTable, slaves, sampleLen);
 
-    packDataStream(tmp, dataLen, internalNetworkStack.dataBuffer);
-  
-    internalNetworkStack.streamData(tmp, frameLen); 
+    if (sampleLen == 0){ //a slave's playback buffer is full, so back off until it advertises more credits
+      if (!starved) flowControlStarved(flowControl);
+      starved = true;
+      xSemaphoreGive(internalNetworkStack.dataBufferMutex);
+      vTaskDelay(FLOW_CONTROL_RETRY_MS);
+      xSemaphoreTake(internalNetworkStack.dataBufferMutex, portMAX_DELAY);
+      continue;
+    }
+    starved = false;
+    waitTicks = pacingDelay(flowControl);
+    if (waitTicks){ //the last paced chunk hasn't had time to play out yet
+      xSemaphoreGive(internalNetworkStack.dataBufferMutex);
+      vTaskDelay(waitTicks);
+      xSemaphoreTake(internalNetworkStack.dataBufferMutex, portMAX_DELAY);
+      continue;
+    }
+    burstStart = esp_timer_get_time();
+    latencyTag = latencyTagBurst(latencyTracker);
+    broadcast = shouldBroadcast(routingTable, slaves, sampleLen);
+    std::copy(internalNetworkStack.dataBuffer.begin(), internalNetworkStack.dataBuffer.begin() + sampleLen, samples);
+    internalNetworkStack.dataBuffer.erase(internalNetworkStack.dataBuffer.begin(), internalNetworkStack.dataBuffer.begin() + sampleLen);
+    xSemaphoreGive(internalNetworkStack.dataBufferMutex); //the A2DP callback can keep appending while the frames go out
+
+    if (broadcast){
+      USE_BLOCK_POOL(stagingPool);
+      headerLen = buildBroadcastHeader(header, routingTable, slaves, latencyTag);
+      staging.clear();
+      appendBroadcastFrame(staging, header, headerLen, samples, sampleLen);
+      padFrame(staging);
+      packAndStream(tmp, staging.size(), staging);
+      metricsCount(COUNTER_BROADCAST_FRAMES);
+    }
+    else {
+      USE_BLOCK_POOL(stagingPool);
+      headerLen = UNICAST_HEADER_SIZE + ((latencyTag < 0) ? 0 : LATENCY_TAG_SIZE);
+      for (int idx = 0; idx < slaveEntries(slaves); idx++){
+        if (!slavePresent(slaves, idx) || maskedLength(routingTable.channelMask[idx], sampleLen) == 0) continue;
+        staging.clear();
+        appendUnicastFrame(staging, samples, sampleLen, slaves.slaves[idx].address, routingTable.channelMask[idx], latencyTag);
+        padFrame(staging);
+        packAndStream(tmp, staging.size(), staging);
+        metricsCount(COUNTER_UNICAST_FRAMES);
+      }
+    }
+    xSemaphoreTake(internalNetworkStack.dataBufferMutex, portMAX_DELAY);
+
+    consumeCredits(flowControl, routingTable, slaves, sampleLen, headerLen, broadcast);
+    latencyConsume(latencyTracker, sampleLen);
+    latencyTagSent(latencyTracker, latencyTag);
+    metricsCount(COUNTER_BURSTS_SENT);
+    fastReconnectFirstAudio();
+    metricsRecord(HISTOGRAM_BURST_BYTES, sampleLen);
+    metricsRecord(HISTOGRAM_BURST_TIME_US, esp_timer_get_time() - burstStart);
 
   }
 }
 
-/*  Gets individual bytes of a 32 bit integer
-*   
-*   @integer - the integer being analyzed
-*   @byteArray - array containing 4 bytes corresponding to a 32 bit integer
-*   @return - the resulting integer
-*/  
-inline void int2Bytes(uint32_t integer, uint8_t * byteArray){
-  for (int offset = 0; offset < 32; offset += 8){
-    byteArray[offset/8] = integer >> offset; //assignment will truncate so only first 8 bits are assigned
+/*  Takes newly received packets off the network stack and queues them for the reception task. The stack signals new packets
+*   by resuming this task, and a resume that arrives while it's awake is lost, so every wakeup drains whatever the stack
+*   has waiting (getPacket() hands back a NONE packet once it's empty). The ring token watchdog also resumes it now and
+*   then, in case a packet arrived between the last drain and the suspend. Looped back packets ("blast local") are taken first.
+*
+*/
+void packetIntakeTask (void * pvParams){
+  while(1){
+
+    vTaskSuspend(NULL);
+    for (int n = 0; n < PACKET_POOL_SIZE; n++){ //bounded, so a stack that keeps receiving can't starve lower priority tasks
+      packetHandle packetReceived = packetLoopbackReceive();
+      if (!packetReceived) packetReceived = packetPoolEmplace([] { return internalNetworkStack.getPacket(); });
+      if (!packetReceived){ //every slot is still held somewhere, so leave the rest with the stack rather than allocate
+        LOG_WARN("Packet pool exhausted, received packets left with the network stack");
+        break;
+      }
+      if (packetReceived->type == NONE) break;
+      metricsCount(COUNTER_PACKETS_RECEIVED);
+      packetQueueSend(packetReceived);
+    }
   }
 }
 
-/*  Unpacks byte array into a 32 bit integer
-*   
-*   @byteArray - array containing 4 bytes corresponding to a 32 bit integer
-*   @return - the resulting integer
-*/  
-inline uint32_t bytes2Int(uint8_t * byteArray){
-  uint32_t integer = 0;
-  for (int offset = 0; offset < 32; offset += 8){
-    integer += byteArray[offset/8] << offset; 
+/*  Logs a ping response
+*
+*   @packet - the received packet
+*/
+void handlePing(BlueteethPacket & packet){
+  LOG_DEBUG("Ping packet type received.");
+  LOG_INFO("Ping response from ADDR%d", packet.srcAddr); //payload isn't safe to log by pointer once the packet goes out of scope
+}
+
+/*  Checks the ring against the saved topology after the slave table changes, and reconnects if it came back as it was
+*
+*/
+void slaveTableUpdated(){
+  static slaveTable_t ring; //copy of slaveTable, only the reception task gets here
+  slaveTableCopy(slaveTable, ring);
+  if (fastReconnectRingUpdated(ring)) performAction(CONNECT, NULL);
+}
+
+/*  Closes enumeration once the initialization packet has made it back around the ring, so every slave has claimed an address
+*
+*   @packet - the received packet
+*/
+void handleEnumerationReturn(BlueteethPacket & packet){
+  finishEnumeration(slaveTable, packet.payload[0]);
+  LOG_INFO("Enumeration assigned %d address(es)", packet.payload[0] - FIRST_SLAVE_ADDRESS);
+  slaveTableUpdated();
+}
+
+/*  Records a slave's capabilities in the slave table
+*
+*   @packet - the received packet
+*/
+void handleSlaveCapabilities(BlueteethPacket & packet){
+  slaveCapabilitiesPayload_t capabilities = payloadDecode<slaveCapabilitiesPayload_t>(packet);
+  slaveInfo_t info;
+  info.address = capabilities.address;
+  info.channels = capabilities.channels;
+  info.codecs = capabilities.codecs;
+  info.maxBaud = capabilities.maxBaud;
+  if (recordSlave(slaveTable, info) == false){
+    LOG_WARN("Capabilities received from invalid address %d", info.address);
+  }
+  else slaveTableUpdated();
+}
+
+/*  Updates a slave's data plane credit limit
+*
+*   @packet - the received packet
+*/
+void handleBufferCredits(BlueteethPacket & packet){
+  int idx = slaveIndex(packet.srcAddr);
+  if (idx >= 0) grantCredits(flowControl, idx, payloadDecode<bufferCreditsPayload_t>(packet).creditLimit);
+}
+
+/*  Records a slave's share of a tagged burst's end-to-end latency
+*
+*   @packet - the received packet
+*/
+void handleLatencyReport(BlueteethPacket & packet){
+  latencyReportPayload_t report = payloadDecode<latencyReportPayload_t>(packet);
+  latencyReport(latencyTracker, slaveIndex(packet.srcAddr), report.tag, report.slaveDelay);
+}
+
+/*  Logs the checksum and time a slave measured for a test stream
+*
+*   @packet - the received packet
+*/
+void handleStreamResults(BlueteethPacket & packet){
+  streamResultsPayload_t results = payloadDecode<streamResultsPayload_t>(packet);
+  if (results.time > 10000){
+    LOG_WARN("Data stream failed");
+  }
+  else {
+    LOG_INFO("Stream results from ADDR%d: Checksum = %d, Time = %d", packet.srcAddr, (uint32_t) results.checksum, (uint32_t) results.time);
   }
-  return integer;
 }
 
-/*  Task that runs when a new Blueteeth packet is received. 
+//Every packet handler. The dispatch table is built from this list by the compiler, so adding an entry is all it takes.
+constexpr packetHandlerEntry_t packetHandlers[] = {
+  {PING, handlePing, "ping"},
+  {INITIALIZAITON, handleEnumerationReturn, "enumeration"},
+  {SLAVE_CAPABILITIES, handleSlaveCapabilities, "slave capabilities"},
+  {BUFFER_CREDITS, handleBufferCredits, "buffer credits"},
+  {LATENCY_REPORT, handleLatencyReport, "latency report"},
+  {STREAM_RESULTS, handleStreamResults, "stream results"},
+};
+static_assert(packetHandlersUnique(packetHandlers, sizeof(packetHandlers) / sizeof(packetHandlers[0])), "a packet type is listed twice in packetHandlers");
+constexpr packetDispatchTable_t packetDispatchTable = makePacketDispatch(packetHandlers);
+
+/*  Task that handles received Blueteeth packets in arrival order, taking every packet that's waiting each time it wakes up.
 *
 */  
 void packetReceptionTask (void * pvParams){
+
+  packetHandle batch[PACKET_BATCH_SIZE];
+  int count;
+
   while(1){
-    
-    vTaskSuspend(packetReceptionTaskHandle);
-    BlueteethPacket packetReceived = internalNetworkStack.getPacket();
 
-    switch(packetReceived.type){
-      
-      case PING:
-        Serial.print("Ping packet type received.\n\r"); //DEBUG STATEMENT
-        Serial.printf("Response from address %s\n\r", packetReceived.payload);
-        break;
-      
-      case STREAM_RESULTS:
-        if (bytes2Int(packetReceived.payload + 4) > 10000){
-          Serial.print("Data stream failed\n\r");
-        }
-        else {
-          Serial.printf("Stream results from ADDR%d: Checksum = %d, Time = %d\n\r", packetReceived.srcAddr, bytes2Int(packetReceived.payload), bytes2Int(packetReceived.payload + 4));
-        }
-        break;
+    count = packetQueueReceiveBatch(batch, PACKET_BATCH_SIZE);
+    metricsRecord(HISTOGRAM_PACKET_BATCH_SIZE, count);
+    metricsGauge(GAUGE_PACKET_QUEUE_DEPTH, uxQueueMessagesWaiting(packetQueue.queue));
 
-      default:
-        // Sometimes read noise on the line
-        // Serial.print("Unknown packet type received.\n\r"); //DEBUG STATEMENT
-        break;
+    for (int idx = 0; idx < count; idx++){
+      dispatchPacket(*batch[idx]);
+      batch[idx].release();
+    }
+  }
+}
+
+/*  Writes queued console text and deferred log records to UART0. This is the only task that touches the UART, so no other task
+*   ever waits on it. Log call sites only copy a few words into a ring, and the formatting happens here.
+*
+*/
+void consoleWriterTask(void * params){
+
+  const char * levels[] = {"", "E", "W", "I", "D"};
+  uint32_t reportedDrops[portNUM_PROCESSORS] = {0};
+  uint32_t reportedConsoleDrops = 0;
+  logRecord_t record;
+  char batch[CONSOLE_BATCH_SIZE];
+  size_t batchLen;
+  uint8_t chunkLen;
+  bool wrote;
+
+  while (1){
+
+    wrote = false;
+
+    for (int core = 0; core < portNUM_PROCESSORS; core++){
+      while (logRead(logRings[core], record)){
+        Serial.printf("[%s%d %u us] ", levels[record.level], core, record.timeUs);
+        Serial.printf(record.format, record.args[0], record.args[1], record.args[2], record.args[3]);
+        Serial.print("\n\r");
+        wrote = true;
+      }
+      uint32_t dropped = logRings[core].dropped.load(std::memory_order_relaxed);
+      if (dropped != reportedDrops[core]){
+        Serial.printf("[log] %u record(s) dropped on core %d\n\r", dropped - reportedDrops[core], core);
+        reportedDrops[core] = dropped;
+      }
+    }
+
+    batchLen = 0;
+    while (batchLen + CONSOLE_CHUNK_SIZE <= sizeof(batch) && consoleTake(batch + batchLen, chunkLen)) batchLen += chunkLen;
+    if (batchLen > 0){
+      Serial.write((const uint8_t *) batch, batchLen);
+      wrote = true;
+    }
+
+    uint32_t droppedBytes = console.droppedBytes.load(std::memory_order_relaxed);
+    if (droppedBytes != reportedConsoleDrops){
+      Serial.printf("[console] %u byte(s) dropped\n\r", droppedBytes - reportedConsoleDrops);
+      reportedConsoleDrops = droppedBytes;
     }
 
+    if (!wrote) ulTaskNotifyTake(pdTRUE, portMAX_DELAY); //console text and log records both notify, so nothing waits on a timeout
   }
 }
 
@@ -210,40 +637,342 @@ void packetReceptionTask (void * pvParams){
 */ 
 void inline printBuffer(int endPos){
 
-  Serial.print("\0337"); //save cursor positon
-  Serial.printf("\033[%dF", endPos + 1); //go up N + 1 lines
+  consolePrint("\0337"); //save cursor positon
+  consolePrintf("\033[%dF", endPos + 1); //go up N + 1 lines
   for (int i = 0; i <= endPos; i++) {
 
-    Serial.print("\033[2K"); //clear line
+    consolePrint("\033[2K"); //clear line
     
     switch(input_buffer[i]){
       case '\0':
-        Serial.printf("Character %d = NULL\n\r", i);
+        consolePrintf("Character %d = NULL\n\r", i);
         break;
       case '\n':
-        Serial.printf("Character %d = NEWLINE\n\r", i);
+        consolePrintf("Character %d = NEWLINE\n\r", i);
         break;
       case 127:
-        Serial.printf("Character %d = BACKSPACE\n\r", i);
+        consolePrintf("Character %d = BACKSPACE\n\r", i);
         break;
       default:
-        Serial.printf("Character %d = %c\n\r", i , input_buffer[i]);
+        consolePrintf("Character %d = %c\n\r", i , input_buffer[i]);
     }
   }
-  Serial.print("\0338"); //restore cursor position
+  consolePrint("\0338"); //restore cursor position
 }
 
 
-#define DATA_STREAM_TIMEOUT (1000)
-void dataStreamMonitorTask (void * pvParams){
-  while(1){
-    vTaskDelay(500);
-    if ((internalNetworkStack.getTimeElapsedSinceLastDataBufferAccess() > DATA_STREAM_TIMEOUT)){
-      // deque<uint8_t>().swap(internalNetworkStack.dataBuffer); 
+/*  Background job behind the "stream" command: loads a test pattern into the stream buffer (as much as its capacity allows),
+*   times a raw 40 kB transfer on the data plane and asks the slaves for their results.
+*
+*   @job - the running job
+*/
+void streamJob(job_t & job){
+
+  if (!jobLockDataPlane(job)) return;
+
+  uint8_t streamArray[255];
+  for (int i = 0; i < 255; i++){
+      streamArray[i]=i+1;
+  }
+
+  size_t loaded = 0;
+  size_t written = 1;
+  xSemaphoreTake(internalNetworkStack.dataBufferMutex, portMAX_DELAY);
+  internalNetworkStack.dataBuffer.resize(0);
+  streamBufferProtect(streamBuffer, true);
+  latencyResync(latencyTracker);
+  {
+    HEAP_EXEMPT(); //dataBuffer is the stack's deque
+    while (loaded < DATA_STREAM_TEST_SIZE && written){
+      written = streamBufferFill(streamBuffer, internalNetworkStack.dataBuffer, streamArray, min((size_t) 255, (size_t) DATA_STREAM_TEST_SIZE - loaded));
+      loaded += written;
+    }
+  }
+  latencyRecordArrival(latencyTracker, loaded);
+  xSemaphoreGive(internalNetworkStack.dataBufferMutex);
+  if (loaded < DATA_STREAM_TEST_SIZE) consolePrintf("Test pattern cut to the stream buffer capacity (%u bytes)\n\r", loaded);
+  uint32_t t = millis();
+
+  uint8_t cnt = 0;
+  while (cnt < 158 && !jobCancelled(job)) {
+    internalNetworkStack.streamData(streamArray, 255);
+    cnt++;
+    jobProgress(job, cnt, 158);
+  }
+
+  t = millis() - t;
+  consolePrintf("40 kByte transmission finished in %d milliseconds\n\r", t);
+
+  packetHandle streamRequest = packetPoolAcquire(false, internalNetworkStack.getAddress(), (uint8_t) 254);
+  if (streamRequest && !jobCancelled(job)){
+    streamRequest->type = STREAM;
+    internalNetworkStack.queuePacket(true, *streamRequest);
+  }
+  streamBufferProtect(streamBuffer, false);
+  jobReleaseDataPlane();
+}
+
+/*  Background job behind the "test" command: streams the sample audio through the packager one chunk at a time
+*
+*   @job - the running job
+*/
+void testJob(job_t & job){
+
+  if (!jobLockDataPlane(job)) return;
+
+  consolePrint("Attempting to stream sample audio data on the data plane\n\r");
+  streamBufferProtect(streamBuffer, true);
+  size_t cnt = 0;
+  size_t cnt2;
+  size_t streamChunk = 40000; //cut to whatever room the stream buffer has
+  while (cnt < sizeof(audioSamples) && !jobCancelled(job)){
+    xSemaphoreTake(internalNetworkStack.dataBufferMutex, portMAX_DELAY);
+    {
+      HEAP_EXEMPT(); //dataBuffer is the stack's deque
+      cnt2 = streamBufferFill(streamBuffer, internalNetworkStack.dataBuffer, audioSamples + cnt, min(streamChunk, sizeof(audioSamples) - cnt));
+      cnt += cnt2;
+    }
+    latencyRecordArrival(latencyTracker, cnt2);
+    size_t depth = internalNetworkStack.dataBuffer.size();
+    xSemaphoreGive(internalNetworkStack.dataBufferMutex);
+    streamControllerDataReceived(streamController, cnt2, depth);
+    streamControllerRequestDrain(streamController); //send the whole chunk, then go idle
+    while (streamController.state != STREAM_IDLE && !jobCancelled(job)){ //the packager finishes the chunk on its own if the job is killed
+      vTaskDelay(1);
+    }
+    jobProgress(job, cnt, sizeof(audioSamples));
+  }
+  streamBufferProtect(streamBuffer, false);
+  jobReleaseDataPlane();
+}
+
+/*  Background job behind "blast": sends pings back to back to load the intake task, packet queue and pool, then waits for
+*   the responses to stop and reports how many made it through
+*
+*   @job - the running job
+*/
+void packetBlastJob(job_t & job){
+
+  uint32_t count = terminalParameters.blastCount;
+  uint32_t responsesBefore = metrics.packetTypes[PING].load(std::memory_order_relaxed);
+  uint32_t receivedBefore = metricsCounterTotal(COUNTER_PACKETS_RECEIVED);
+  uint32_t exhaustedBefore = metricsCounterTotal(COUNTER_PACKET_POOL_EXHAUSTED);
+  uint32_t sent = 0;
+  uint32_t responses = 0;
+  uint32_t lastResponses;
+  uint32_t t = millis();
+
+  while (sent < count && !jobCancelled(job)){
+    packetHandle ping = packetPoolAcquire(false, internalNetworkStack.getAddress(), (uint8_t) 254);
+    if (!ping){ //received packets hold every slot, let the reception task catch up
+      vTaskDelay(1);
+      continue;
+    }
+    ping->type = PING;
+    internalNetworkStack.queuePacket(1, *ping);
+    jobProgress(job, ++sent, count);
+  }
+  uint32_t sendTime = millis() - t;
+
+  do { //responses are still coming around the ring
+    lastResponses = responses;
+    vTaskDelay(PACKET_BLAST_SETTLE_MS);
+    responses = metrics.packetTypes[PING].load(std::memory_order_relaxed) - responsesBefore;
+  } while (responses != lastResponses && !jobCancelled(job));
+
+  consolePrintf("Sent %u pings in %u ms, %u responses (%u per ping) after %u ms\n\r", sent, sendTime, responses,
+    sent ? responses / sent : 0, millis() - t);
+  consolePrintf("%u packets received, %u dropped with the pool exhausted, peak queue depth %d\n\r",
+    metricsCounterTotal(COUNTER_PACKETS_RECEIVED) - receivedBefore, metricsCounterTotal(COUNTER_PACKET_POOL_EXHAUSTED) - exhaustedBefore,
+    metrics.gaugePeaks[GAUGE_PACKET_QUEUE_DEPTH].load(std::memory_order_relaxed));
+}
+
+/*  Background job behind "blast local": stands in for the network stack, leaving LOOPBACK packets for the intake task and
+*   resuming it after each one, then waits for dispatch to stop counting them and checks every one came out. No slaves are
+*   needed, so this checks the intake wakeups, pool, queue and reception task on their own. A packet left behind by a lost
+*   wakeup shows as missing (and as stranded, until the watchdog's next resume picks it up).
+*
+*   @job - the running job
+*/
+void packetLoopbackJob(job_t & job){
+
+  uint32_t count = terminalParameters.blastCount;
+  uint32_t dispatchedBefore = metrics.packetTypes[LOOPBACK].load(std::memory_order_relaxed);
+  uint32_t exhaustedBefore = metricsCounterTotal(COUNTER_PACKET_POOL_EXHAUSTED);
+  uint32_t queued = 0;
+  uint32_t dispatched = 0;
+  uint32_t lastDispatched;
+  uint32_t t = millis();
+
+  while (queued < count && !jobCancelled(job)){
+    packetHandle packet = packetPoolAcquire(false, internalNetworkStack.getAddress(), internalNetworkStack.getAddress());
+    if (!packet){ //the reception task still holds every slot, let it catch up
+      vTaskDelay(1);
+      continue;
+    }
+    packet->type = LOOPBACK;
+    packetLoopbackSend(packet);
+    vTaskResume(packetIntakeTaskHandle); //how the stack signals a received packet
+    jobProgress(job, ++queued, count);
+  }
+  uint32_t queueTime = millis() - t;
+
+  do { //the intake and reception tasks are still working through their queues
+    lastDispatched = dispatched;
+    vTaskDelay(PACKET_BLAST_SETTLE_MS);
+    dispatched = metrics.packetTypes[LOOPBACK].load(std::memory_order_relaxed) - dispatchedBefore;
+  } while (dispatched != lastDispatched && !jobCancelled(job));
+
+  consolePrintf("Looped back %u packets in %u ms, %u dispatched after %u ms: %s\n\r", queued, queueTime, dispatched, millis() - t,
+    (dispatched == queued) ? "none lost" : "LOST PACKETS");
+  consolePrintf("%u stranded waiting for an intake wakeup\n\r", uxQueueMessagesWaiting(packetQueue.loopback));
+  consolePrintf("%u waits with the pool exhausted, peak queue depth %d\n\r", metricsCounterTotal(COUNTER_PACKET_POOL_EXHAUSTED) - exhaustedBefore,
+    metrics.gaugePeaks[GAUGE_PACKET_QUEUE_DEPTH].load(std::memory_order_relaxed));
+}
+
+/*  Hands a command to the job workers so the terminal stays responsive while it runs
+*
+*   @name - job name (must be a literal)
+*   @function - the job
+*/
+void startJob(const char * name, jobFunction_t function){
+  int id = jobSubmit(name, function);
+  if (id < 0) consolePrint("Too many jobs queued or running, kill one or wait for it to finish\n\r");
+  else consolePrintf("Started job %d (%s)\n\r", id, name);
+}
+
+/*  Runs jobs from the job queue. There are JOB_WORKERS of these, so that many jobs can run at once.
+*
+*/
+void jobWorkerTask(void * params){
+  uint8_t idx;
+  consoleInteractive = true; //job output is usually a report, it gets the reserved console chunks
+  while (1){
+    xQueueReceive(jobRunner.queue, &idx, portMAX_DELAY);
+    jobRun(jobRunner.jobs[idx]);
+  }
+}
+
+/*  Takes a pool slot for a packet from the master
+*
+*   @return - handle to the packet, empty (with a message) if the pool is exhausted
+*/
+packetHandle acquireOutgoingPacket(){
+  packetHandle packet = packetPoolAcquire(false, internalNetworkStack.getAddress(), (uint8_t) 254);
+  if (!packet) consolePrint("Packet pool exhausted, no packet can be sent\n\r");
+  return packet;
+}
+
+/*  Carries out the action a terminal command asked for
+*
+*   @action - returned by handle_input
+*   @job - the benchmark job running the command, or NULL when it was typed in (long commands then start a job of their own)
+*/
+void performAction(PacketType action, job_t * job){
+
+  packetHandle newPacket; //Need to declare prior to switch statement to avoid "crosses initilization" error. Only cases that send fill it.
+  uint8_t addresses[MAX_SLAVES];
+  int numAddresses;
+
+  switch (action){
+    
+    case CONNECT:
+      if (!(newPacket = acquireOutgoingPacket())) break;
+      fastReconnectConnecting(fastReconnectName());
+      newPacket->type = CONNECT;
+      numAddresses = slaveAddresses(slaveTable, addresses);
+      for (int idx = 0; idx < numAddresses; idx++){
+        newPacket->dstAddr = addresses[idx];
+        snprintf((char *) newPacket->payload, PACKET_PAYLOAD_SIZE, "%s", fastReconnectName());
+        internalNetworkStack.queuePacket(1, *newPacket);
+      }
+      break;
+    
+    case DROP:
       xSemaphoreTake(internalNetworkStack.dataBufferMutex, portMAX_DELAY);
-      internalNetworkStack.dataBuffer.resize(0);
+      internalNetworkStack.dataBuffer.clear();
+      latencyResync(latencyTracker);
       xSemaphoreGive(internalNetworkStack.dataBufferMutex);
-      // Serial.printf("Timeout achieved (new size is %d)\n\r", internalNetworkStack.dataBuffer.size());
+      // newPacket.type = DROP;
+      // internalNetworkStack.queuePacket(1, newPacket);
+      break;
+    
+    case DISCONNECT:
+      if (!(newPacket = acquireOutgoingPacket())) break;
+      newPacket->dstAddr = 1;
+      newPacket->type = DISCONNECT;
+      internalNetworkStack.queuePacket(1, *newPacket);
+      break;
+
+    case PING:
+      if (!(newPacket = acquireOutgoingPacket())) break;
+      newPacket->type = PING;
+      internalNetworkStack.queuePacket(1, *newPacket);
+      break;
+
+    case INITIALIZAITON:
+      //Each slave claims the address in payload[0], increments it, forwards the packet and then reports its capabilities.
+      //The packet returning to the master tells us how many addresses were handed out.
+      if (!(newPacket = acquireOutgoingPacket())) break;
+      resetSlaveTable(slaveTable);
+      resetFlowControl(flowControl);
+      newPacket->dstAddr = BROADCAST_ADDRESS;
+      newPacket->type = INITIALIZAITON;
+      newPacket->payload[0] = FIRST_SLAVE_ADDRESS;
+      internalNetworkStack.queuePacket(1, *newPacket);
+      break;
+
+    case STREAM:
+      if (job != NULL) streamJob(*job);
+      else startJob("stream", streamJob);
+      break;
+
+    case TEST:
+      if (job != NULL) testJob(*job);
+      else startJob("test", testJob);
+      break;
+      
+    default:
+      break;
+      //no action needed
+
+  }
+}
+
+/*  Background job behind "bench run": runs the benchmark script and reports min/mean/p99/max per command (and per sweep value)
+*
+*   @job - the running job
+*/
+void benchJob(job_t & job){
+
+  char line[BENCH_LINE_SIZE];
+  int32_t value = benchScript.sweeping ? benchScript.sweepFrom : 0;
+  uint32_t steps = benchScript.sweeping ? (benchScript.sweepTo - benchScript.sweepFrom) / benchScript.sweepStep + 1 : 1;
+  uint32_t total = steps * benchScript.repeats * benchScript.numLines;
+  uint32_t done = 0;
+  uint32_t runs;
+  uint32_t start;
+
+  benchScript.numResults = 0;
+  printBenchHeader(false);
+
+  for (uint32_t step = 0; step < steps && !jobCancelled(job); step++, value += benchScript.sweepStep){
+    for (runs = 0; runs < benchScript.repeats && !jobCancelled(job); runs++){
+      for (uint8_t idx = 0; idx < benchScript.numLines; idx++){
+        benchExpandLine(line, benchScript.lines[idx], value);
+        start = micros();
+        performAction(handle_input(line, terminalParameters), &job);
+        benchScript.samples[idx][runs] = micros() - start;
+        jobProgress(job, ++done, total);
+      }
+    }
+    for (uint8_t idx = 0; idx < benchScript.numLines && runs > 0; idx++){
+      benchResult_t result;
+      benchSummarize(benchScript.samples[idx], runs, result);
+      result.sweepValue = value;
+      result.line = idx;
+      printBenchResult(result, false);
+      if (benchScript.numResults < BENCH_MAX_RESULTS) benchScript.results[benchScript.numResults++] = result;
     }
   }
 }
@@ -253,16 +982,13 @@ void dataStreamMonitorTask (void * pvParams){
 */
 void terminalInputTask(void * params) {
 
+  consoleInteractive = true; //command output (tables, dumps) gets the reserved console chunks
   clear_buffer(input_buffer, sizeof(input_buffer));
   int buffer_pos = 0;
-  BLEScanResults scanResults;
-  const char * btTarget;
   
   while(1){
 
-    vTaskDelay(100);
-
-    xSemaphoreTake(uartMutex, portMAX_DELAY);
+    ulTaskNotifyTake(pdTRUE, portMAX_DELAY); //sleep until the UART driver reports input
 
     while (Serial.available() && (buffer_pos < MAX_BUFFER_SIZE)){ //get number of bits on buffer
       
@@ -272,128 +998,26 @@ void terminalInputTask(void * params) {
       if (input_buffer[buffer_pos] == '\r') { //If an enter character is received
         
         input_buffer[buffer_pos] = '\0'; //Get rid of the carriage return
-        Serial.print("\n\r");
+        consolePrint("\n\r");
         
-        BlueteethPacket newPacket (false, internalNetworkStack.getAddress(), 254); //Need to declare prior to switch statement to avoid "crosses initilization" error.
-
-        switch ( handle_input(input_buffer, terminalParameters) ){
-          
-          case CONNECT:
-            newPacket.dstAddr = 1;
-            newPacket.type = CONNECT;
-            for (int address = 1; address <= 3; address++){
-              newPacket.dstAddr = address;
-              sprintf((char *) newPacket.payload, "Wireless Speaker");
-              internalNetworkStack.queuePacket(1, newPacket);
-            }
-            break;
-          
-          case DROP:
-            xSemaphoreTake(internalNetworkStack.dataBufferMutex, portMAX_DELAY);
-            internalNetworkStack.dataBuffer.clear();
-            xSemaphoreGive(internalNetworkStack.dataBufferMutex);
-            // newPacket.type = DROP;
-            // internalNetworkStack.queuePacket(1, newPacket);
-            break;
-          
-          case DISCONNECT:
-            newPacket.dstAddr = 1;
-            newPacket.type = DISCONNECT;
-            internalNetworkStack.queuePacket(1, newPacket);
-            break;
-
-          case PING:
-            newPacket.type = PING;
-            internalNetworkStack.queuePacket(1, newPacket);
-            break;
-
-          case INITIALIZAITON:
-            newPacket.dstAddr = 255;
-            newPacket.type = INITIALIZAITON;
-            newPacket.payload[0] = 1;
-            internalNetworkStack.queuePacket(1, newPacket);
-            break;
-
-          case STREAM: {
-            
-            internalNetworkStack.recordDataBufferAccessTime(); //This will stop the data stream monitor from resetting buffer
-            xSemaphoreTake(internalNetworkStack.dataBufferMutex, portMAX_DELAY);
-            internalNetworkStack.dataBuffer.resize(0);
-            for (int i = 0; i < DATA_STREAM_TEST_SIZE; i++){
-              internalNetworkStack.dataBuffer.push_back( (i % 255) + 1 );
-            }
-            xSemaphoreGive(internalNetworkStack.dataBufferMutex);
-            uint32_t t = millis();
-
-            uint8_t streamArray[255];
-            for (int i = 0; i < 255; i++){
-                streamArray[i]=i+1;
-            }
-            uint8_t cnt = 0;
-            while (cnt < 158) {
-              internalNetworkStack.streamData(streamArray, 255);
-              cnt++;
-            }
-
-            t = millis() - t;
-            Serial.printf("40 kByte transmission finished in %d milliseconds\n\r", t);
-            
-            BlueteethPacket streamRequest(false, internalNetworkStack.getAddress(), 254);
-            streamRequest.type = STREAM;
-            internalNetworkStack.queuePacket(true, streamRequest);
-            break;
-          }
-
-          case TEST: {
-            
-            Serial.print("Attempting to stream sample audio data on the data plane\n\r");
-            int cnt = 0;
-            int cnt2;
-            int streamChunk = 40000;
-            while (cnt < sizeof(audioSamples)){
-              internalNetworkStack.recordDataBufferAccessTime(); //This will stop the data buffer monitor from resetting buffer
-              xSemaphoreTake(internalNetworkStack.dataBufferMutex, portMAX_DELAY);
-              cnt2 = 0;
-              while ( (cnt2 < streamChunk) && (cnt < sizeof(audioSamples))) {
-                internalNetworkStack.dataBuffer.push_back(audioSamples[cnt++]);
-                cnt2++;
-              }
-              xSemaphoreGive(internalNetworkStack.dataBufferMutex);
-              if (streamActive == false){
-                vTaskResume(dataStreamPackagerTaskHandle);
-                streamActive = true;
-              }
-              while (streamActive){
-               //Do nothing
-              }
-            }
-            break;
-          }
-            
-          default:
-            break;
-            //no action needed
-
-        } //handle the input
+        performAction(handle_input(input_buffer, terminalParameters), NULL);
         clear_buffer(input_buffer, sizeof(input_buffer));
         buffer_pos = -1; //return the buffer back to zero (incrimented after this statement)
         // Serial.printf("Buffer pos is %d", buffer_pos);
       }
       
       else if (input_buffer[buffer_pos] == 127){ //handle a backspace character
-        Serial.printf("%c", 127); //print out backspace
+        consolePrintf("%c", 127); //print out backspace
         input_buffer[buffer_pos] = '\0'; //clear the backspace 
         if (buffer_pos > 0) input_buffer[--buffer_pos] = '\0'; //clear the previous buffer pos if there was another character in the buffer that wasn't a backspace
         buffer_pos--;
       }
       
-      else Serial.printf("%c", input_buffer[buffer_pos]);
+      else consolePrintf("%c", input_buffer[buffer_pos]);
 
       buffer_pos++;
       
     }
 
-    xSemaphoreGive(uartMutex);
-
   }
 }
\ No newline at end of file
@@ -0,0 +1,149 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <Arduino.h>
+#include "jobs.h"
+#include "console.h"
+
+#define BENCH_MAX_LINES (8) //commands in a script
+#define BENCH_LINE_SIZE (100) //same as the terminal's input buffer
+#define BENCH_MAX_REPEATS (100) //timed runs of each command per sweep value
+#define BENCH_MAX_RESULTS (64) //summary rows kept for "bench csv"
+#define BENCH_SWEEP_MARK '$' //replaced with the sweep value when a command runs
+
+typedef struct {
+  int32_t sweepValue;
+  uint8_t line;
+  uint32_t runs;
+  uint32_t minUs;
+  uint32_t meanUs;
+  uint32_t p99Us;
+  uint32_t maxUs;
+} benchResult_t;
+
+/*  A benchmark script: terminal commands run in order, repeated, optionally once per value of a swept parameter.
+*   Only one script exists, and it can't be edited from the moment a run is queued until it ends. A run times each command
+*   until performAction returns, i.e. until its packets are queued on the ring, not until the slaves reply.
+*/
+typedef struct {
+  char lines[BENCH_MAX_LINES][BENCH_LINE_SIZE];
+  uint8_t numLines;
+  uint32_t repeats;
+  bool sweeping;
+  int32_t sweepFrom;
+  int32_t sweepTo;
+  int32_t sweepStep;
+  uint32_t samples[BENCH_MAX_LINES][BENCH_MAX_REPEATS]; //microseconds per run, for the current sweep value
+  benchResult_t results[BENCH_MAX_RESULTS];
+  uint16_t numResults;
+  int jobId; //job running the script, it's locked while that job is queued or running
+} benchScript_t;
+
+extern benchScript_t benchScript;
+
+void benchJob(job_t & job); //defined in the sketch, since it runs terminal commands
+
+/*  Checks whether a run is queued or in progress
+*
+*/
+inline bool benchRunning(){
+  return benchScript.jobId > 0 && jobActive(benchScript.jobId);
+}
+
+/*  Appends a command to the script
+*
+*   @words - the command and its arguments
+*   @numWords - number of words
+*   @return - false if the script is full or the command is too long
+*/
+inline bool benchAddLine(char ** words, uint8_t numWords){
+  if (benchScript.numLines >= BENCH_MAX_LINES) return false;
+  char * line = benchScript.lines[benchScript.numLines];
+  size_t length = 0;
+  for (uint8_t word = 0; word < numWords; word++){
+    size_t wordLength = strlen(words[word]);
+    if (length + wordLength + 1 >= BENCH_LINE_SIZE) return false;
+    if (word > 0) line[length++] = ' ';
+    memcpy(line + length, words[word], wordLength);
+    length += wordLength;
+  }
+  line[length] = '\0';
+  benchScript.numLines++;
+  return true;
+}
+
+/*  Copies a script line, replacing every BENCH_SWEEP_MARK with the sweep value
+*
+*   @out - BENCH_LINE_SIZE bytes
+*   @line - the script line
+*   @value - current sweep value
+*/
+inline void benchExpandLine(char * out, const char * line, int32_t value){
+  size_t length = 0;
+  for (; *line != '\0' && length < BENCH_LINE_SIZE - 1; line++){
+    if (*line != BENCH_SWEEP_MARK) out[length++] = *line;
+    else length += snprintf(out + length, BENCH_LINE_SIZE - length, "%d", value);
+  }
+  out[min(length, (size_t) (BENCH_LINE_SIZE - 1))] = '\0';
+}
+
+/*  Reduces one command's timed runs to min/mean/p99/max
+*
+*   @samples - run times in microseconds (sorted in place)
+*   @runs - number of samples
+*   @result - filled in (sweep value and line are left to the caller)
+*/
+inline void benchSummarize(uint32_t * samples, uint32_t runs, benchResult_t & result){
+  for (uint32_t i = 1; i < runs; i++){ //insertion sort, there are at most BENCH_MAX_REPEATS samples
+    uint32_t sample = samples[i];
+    uint32_t j = i;
+    for (; j > 0 && samples[j - 1] > sample; j--) samples[j] = samples[j - 1];
+    samples[j] = sample;
+  }
+  uint64_t sum = 0;
+  for (uint32_t i = 0; i < runs; i++) sum += samples[i];
+  result.runs = runs;
+  result.minUs = runs ? samples[0] : 0;
+  result.maxUs = runs ? samples[runs - 1] : 0;
+  result.meanUs = runs ? sum / runs : 0;
+  result.p99Us = runs ? samples[(runs * 99 + 99) / 100 - 1] : 0;
+}
+
+/*  Prints one summary row
+*
+*   @result - the row
+*   @csv - true for CSV output
+*/
+inline void printBenchResult(const benchResult_t & result, bool csv){
+  const char * command = benchScript.lines[result.line];
+  if (csv) consolePrintf("%d,\"%s\",%u,%u,%u,%u,%u\n\r", result.sweepValue, command, result.runs, result.minUs, result.meanUs, result.p99Us, result.maxUs);
+  else consolePrintf("%8d %-30s %5u %10u %10u %10u %10u\n\r", result.sweepValue, command, result.runs, result.minUs, result.meanUs, result.p99Us, result.maxUs);
+}
+
+/*  Prints the column headings for summary rows
+*
+*   @csv - true for CSV output
+*/
+inline void printBenchHeader(bool csv){
+  if (csv) consolePrint("sweep,command,runs,min_us,mean_us,p99_us,max_us\n\r");
+  else consolePrintf("%8s %-30s %5s %10s %10s %10s %10s\n\r", "sweep", "command", "runs", "min us", "mean us", "p99 us", "max us");
+}
+
+/*  Prints the results of the last run
+*
+*   @csv - true for CSV output
+*/
+inline void printBenchResults(bool csv){
+  printBenchHeader(csv);
+  for (uint16_t idx = 0; idx < benchScript.numResults; idx++) printBenchResult(benchScript.results[idx], csv);
+}
+
+/*  Prints the script
+*
+*/
+inline void printBenchScript(){
+  if (benchScript.numLines == 0) consolePrint("Script is empty, add commands with bench add <command>\n\r");
+  for (uint8_t line = 0; line < benchScript.numLines; line++) consolePrintf("%d: %s\n\r", line, benchScript.lines[line]);
+}
+
+#endif
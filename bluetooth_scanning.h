@@ -1,32 +1,338 @@
+#ifndef BLUETOOTH_SCANNING_H
+#define BLUETOOTH_SCANNING_H
+
 #include <BLEDevice.h>
 #include <BLEUtils.h>
 #include <BLEScan.h>
 #include <BLEAdvertisedDevice.h>
+#include <esp_heap_caps.h>
+#include "static_allocation.h"
+#include "console.h"
+
+#define BLE_SCAN_CACHE_SIZE (32) //devices remembered, the least recently seen is evicted when a new one shows up
+#define BLE_SCAN_INDEX_SIZE (64) //hash slots (power of 2, twice the cache so probes stay short)
+#define BLE_SCAN_NAME_SIZE (32)
+#define BLE_SCAN_DEFAULT_SECONDS (5)
+#define BLE_RSSI_SHIFT (4) //RSSI is averaged in 1/16 dBm
+#define BLE_RSSI_EWMA_SHIFT (2) //each advertisement moves the average a quarter of the way
+#define BLE_RELEASE_SETTLE_MS (200) //after A2DP stops accepting connections, before checking nothing is connecting
+
+typedef struct {
+  uint8_t address[6];
+  char name[BLE_SCAN_NAME_SIZE];
+  int16_t rssi; //EWMA, in 1/(1 << BLE_RSSI_SHIFT) dBm
+  uint32_t lastSeen; //millis()
+  uint32_t advertisements;
+  bool used;
+} bleDevice_t;
+
+/*  Devices heard during scans, keyed by address. The BLE stack's task adds advertisements while the terminal reads, so every
+*   access goes through the lock. "scan list" keeps the order it printed so "select <n>" picks what the user saw.
+*/
+typedef struct {
+  bleDevice_t devices[BLE_SCAN_CACHE_SIZE];
+  uint8_t index[BLE_SCAN_INDEX_SIZE]; //device slot + 1, 0 = empty
+  uint8_t listed[BLE_SCAN_CACHE_SIZE][6]; //addresses in the order of the last "scan list"
+  uint8_t numListed;
+  uint8_t selected[6];
+  char selectedName[BLE_SCAN_NAME_SIZE];
+  bool haveSelection;
+  volatile bool scanning;
+  volatile bool releasing; //BLE is being shut down, no scan can start until it's done
+  volatile bool sourceBusy; //an A2DP source is connecting or connected, so BLE (which shares Bluedroid with A2DP) stays up
+  volatile bool releaseController; //"scan release": also give the BLE controller's memory back on the next release
+  volatile bool controllerReleased; //done, BLE can't come back up until a reset
+  TaskHandle_t releaser; //task that shuts BLE down (setup()'s task, it has the stack A2DP's start needs)
+  BLEScan * scan; //NULL while BLE is down (it comes up with a scan and goes down after)
+  uint32_t heapBeforeInit; //internal free heap around BLE bring-up, after the last scan and after release, to show what BLE costs
+  uint32_t heapAfterInit;
+  uint32_t heapAfterScan;
+  uint32_t heapAfterRelease;
+  portMUX_TYPE lock;
+} bleScanCache_t;
+
+extern bleScanCache_t bleScanCache;
+
+void bleRelease(); //defined in the sketch, since BLE can only come down together with A2DP
 
-extern int discoveryIdx;
+/*  Hashes a device address into the index
+*
+*   @address - 6 byte BLE address
+*/
+inline uint32_t bleAddressHash(const uint8_t * address){
+  uint32_t hash = 2166136261u;
+  for (int i = 0; i < 6; i++) hash = (hash ^ address[i]) * 16777619u;
+  return hash & (BLE_SCAN_INDEX_SIZE - 1);
+}
+
+/*  Finds a cached device (call with the lock held)
+*
+*   @address - 6 byte BLE address
+*   @return - the device's slot, or -1
+*/
+inline int bleScanFind(const uint8_t * address){
+  for (uint32_t probe = bleAddressHash(address), n = 0; n < BLE_SCAN_INDEX_SIZE; probe = (probe + 1) & (BLE_SCAN_INDEX_SIZE - 1), n++){
+    uint8_t slot = bleScanCache.index[probe];
+    if (slot == 0) return -1;
+    if (0 == memcmp(bleScanCache.devices[slot - 1].address, address, 6)) return slot - 1;
+  }
+  return -1;
+}
+
+/*  Puts a device slot into the index (call with the lock held)
+*
+*   @slot - device slot
+*/
+inline void bleScanIndex(int slot){
+  uint32_t probe = bleAddressHash(bleScanCache.devices[slot].address);
+  while (bleScanCache.index[probe] != 0) probe = (probe + 1) & (BLE_SCAN_INDEX_SIZE - 1);
+  bleScanCache.index[probe] = slot + 1;
+}
 
-class MyAdvertisedDeviceCallbacks: public BLEAdvertisedDeviceCallbacks {
+/*  Empties the cache (the selection is kept)
+*
+*/
+inline void bleScanClear(){
+  portENTER_CRITICAL(&bleScanCache.lock);
+  memset(bleScanCache.devices, 0, sizeof(bleScanCache.devices));
+  memset(bleScanCache.index, 0, sizeof(bleScanCache.index));
+  bleScanCache.numListed = 0;
+  portEXIT_CRITICAL(&bleScanCache.lock);
+}
+
+/*  Records an advertisement, evicting the least recently seen device if the cache is full
+*
+*   @address - 6 byte BLE address
+*   @name - advertised name, or an empty string
+*   @rssi - signal strength in dBm
+*/
+inline void bleScanRecord(const uint8_t * address, const char * name, int rssi){
+  portENTER_CRITICAL(&bleScanCache.lock);
+  int slot = bleScanFind(address);
+  bool fresh = (slot < 0);
+  if (fresh){
+    for (int idx = 0; idx < BLE_SCAN_CACHE_SIZE; idx++){
+      if (!bleScanCache.devices[idx].used){
+        slot = idx;
+        break;
+      }
+      if (slot < 0 || (int32_t) (bleScanCache.devices[idx].lastSeen - bleScanCache.devices[slot].lastSeen) < 0) slot = idx;
+    }
+    if (bleScanCache.devices[slot].used){ //evicting, open addressing can't delete in place so rebuild the index without it
+      bleScanCache.devices[slot].used = false;
+      memset(bleScanCache.index, 0, sizeof(bleScanCache.index));
+      for (int idx = 0; idx < BLE_SCAN_CACHE_SIZE; idx++) if (bleScanCache.devices[idx].used) bleScanIndex(idx);
+    }
+    bleDevice_t & device = bleScanCache.devices[slot];
+    memcpy(device.address, address, 6);
+    device.name[0] = '\0';
+    device.rssi = rssi << BLE_RSSI_SHIFT;
+    device.advertisements = 0;
+    device.used = true;
+    bleScanIndex(slot);
+  }
+  bleDevice_t & device = bleScanCache.devices[slot];
+  if (!fresh) device.rssi += ((rssi << BLE_RSSI_SHIFT) - device.rssi) >> BLE_RSSI_EWMA_SHIFT;
+  if (name[0] != '\0') strlcpy(device.name, name, sizeof(device.name)); //scan responses carry the name, plain advertisements often don't
+  device.lastSeen = millis();
+  device.advertisements++;
+  portEXIT_CRITICAL(&bleScanCache.lock);
+}
+
+class BleScanCallbacks: public BLEAdvertisedDeviceCallbacks {
     void onResult(BLEAdvertisedDevice advertisedDevice) {
-      // Serial.print("\033[F"); //go up one line
-      Serial.print("\033[2K"); //clear line
-      Serial.printf("Device [%d] : %s \n\r", discoveryIdx++, advertisedDevice.getName().c_str());
+      bleScanRecord(*advertisedDevice.getAddress().getNative(), advertisedDevice.getName().c_str(), advertisedDevice.getRSSI());
       // Serial.printf("Advertised Device: %s \n\r", advertisedDevice.toString().c_str());
     }
 };
 
-BLEScan * bleScanSetup(){
-  BLEDevice::init("");
-  BLEScan * pBLEScan = BLEDevice::getScan(); //create new scan
-  pBLEScan->setAdvertisedDeviceCallbacks(new MyAdvertisedDeviceCallbacks());
-  pBLEScan->setInterval(100);
-  pBLEScan->setWindow(99);  // less or equal setInterval value
-  pBLEScan -> setActiveScan(true);
-  return pBLEScan;
+BleScanCallbacks bleScanCallbacks;
+
+/*  Sets up the cache. Must run before the first scan.
+*
+*/
+inline void bleScanInit(){
+  memset(&bleScanCache, 0, sizeof(bleScanCache));
+  bleScanCache.lock = portMUX_INITIALIZER_UNLOCKED;
+}
+
+/*  Asks the releasing task to shut BLE down. Can't be done from the BLE stack's own task or a small job stack.
+*
+*/
+inline void bleScanRequestRelease(){
+  if (bleScanCache.releaser != NULL) xTaskNotifyGive(bleScanCache.releaser);
+}
+
+/*  Records whether an A2DP source is connecting or connected (called from the A2DP connection callback)
+*
+*   @busy - true unless the source has disconnected
+*/
+inline void bleScanSourceState(bool busy){
+  portENTER_CRITICAL(&bleScanCache.lock);
+  bleScanCache.sourceBusy = busy;
+  portEXIT_CRITICAL(&bleScanCache.lock);
+  if (!busy) bleScanRequestRelease(); //BLE may have been kept up for the source
+}
+
+/*  Called by the BLE stack when a scan's time is up
+*
+*   @results - the stack's own copy of the results (unused, the cache has them)
+*/
+inline void bleScanComplete(BLEScanResults results){
+  bleScanCache.scan->clearResults(); //the stack keeps every device it heard until told otherwise
+  bleScanCache.heapAfterScan = heap_caps_get_free_size(MALLOC_CAP_INTERNAL);
+  bleScanCache.scanning = false;
+  uint8_t devices = 0;
+  for (int idx = 0; idx < BLE_SCAN_CACHE_SIZE; idx++) devices += bleScanCache.devices[idx].used;
+  consolePrintf("Scan finished, %u devices cached (scan list to show them)\n\r", devices);
+  bleScanRequestRelease(); //can't shut the stack down from its own task
+}
+
+/*  Starts a scan in the background, bringing BLE up the first time
+*
+*   @seconds - scan duration
+*   @return - false if a scan is already running, BLE is being shut down or its controller memory was released
+*/
+inline bool bleScanStart(uint32_t seconds){
+  portENTER_CRITICAL(&bleScanCache.lock);
+  bool busy = bleScanCache.scanning || bleScanCache.releasing || bleScanCache.controllerReleased;
+  if (!busy) bleScanCache.scanning = true;
+  portEXIT_CRITICAL(&bleScanCache.lock);
+  if (busy) return false;
+
+  if (bleScanCache.scan == NULL){
+    HEAP_EXEMPT(); //BLE allocates its host state on init, and frees it again when it's released
+    bleScanCache.heapBeforeInit = heap_caps_get_free_size(MALLOC_CAP_INTERNAL);
+    BLEDevice::init(""); //joins the Bluedroid host A2DP already started, so only the BLE side is set up here
+    bleScanCache.scan = BLEDevice::getScan();
+    bleScanCache.scan->setAdvertisedDeviceCallbacks(&bleScanCallbacks, true); //duplicates keep the RSSI average and last seen time current
+    bleScanCache.scan->setInterval(100);
+    bleScanCache.scan->setWindow(99); // less or equal setInterval value
+    bleScanCache.scan->setActiveScan(true);
+    bleScanCache.heapAfterInit = heap_caps_get_free_size(MALLOC_CAP_INTERNAL);
+  }
+  if (!bleScanCache.scan->start(seconds, bleScanComplete, true)){
+    bleScanCache.scanning = false;
+    return false;
+  }
+  return true;
 }
 
+/*  Stops a running scan early
+*
+*/
+inline void bleScanStop(){
+  portENTER_CRITICAL(&bleScanCache.lock);
+  bool running = bleScanCache.scanning && bleScanCache.scan != NULL; //scanning is set a moment before BLE is brought up
+  portEXIT_CRITICAL(&bleScanCache.lock);
+  if (!running) return;
+  bleScanCache.scan->stop();
+  bleScanCache.scan->clearResults();
+  bleScanCache.heapAfterScan = heap_caps_get_free_size(MALLOC_CAP_INTERNAL);
+  bleScanCache.scanning = false;
+  bleScanRequestRelease();
+}
+
+/*  Checks whether there's anything for a release to do
+*
+*/
+inline bool bleScanReleaseWanted(){
+  return (bleScanCache.scan != NULL || (bleScanCache.releaseController && !bleScanCache.controllerReleased)) && !bleScanCache.scanning;
+}
+
+/*  Claims BLE for shutting down. The sketch makes A2DP non-connectable first, so once this succeeds no source can
+*   connect until A2DP is started again.
+*
+*   @return - false if there's nothing to release, a scan has started since (the release then waits for that scan to finish)
+*   or a source is connecting or connected (it waits for the disconnect)
+*/
+inline bool bleScanBeginRelease(){
+  portENTER_CRITICAL(&bleScanCache.lock);
+  bool release = bleScanReleaseWanted() && !bleScanCache.releasing && !bleScanCache.sourceBusy;
+  if (release) bleScanCache.releasing = true;
+  portEXIT_CRITICAL(&bleScanCache.lock);
+  return release;
+}
+
+/*  Marks BLE as down once the sketch has deinitialized it, and reports the memory it gave back
+*
+*/
+inline void bleScanEndRelease(){
+  bleScanCache.scan = NULL;
+  bleScanCache.heapAfterRelease = heap_caps_get_free_size(MALLOC_CAP_INTERNAL);
+  bleScanCache.releasing = false;
+  consolePrintf("BLE down%s, internal heap %u -> %u bytes free\n\r", bleScanCache.controllerReleased ? " and its controller memory released" : "",
+    bleScanCache.heapAfterScan, bleScanCache.heapAfterRelease);
+}
+
+/*  Prints the cached devices strongest first and remembers the order for "select"
+*
+*/
+inline void printBleScanCache(){
+  uint8_t order[BLE_SCAN_CACHE_SIZE];
+  uint8_t count = 0;
+  uint32_t now = millis();
+
+  portENTER_CRITICAL(&bleScanCache.lock);
+  for (int idx = 0; idx < BLE_SCAN_CACHE_SIZE; idx++){ //insertion sort by average RSSI
+    if (!bleScanCache.devices[idx].used) continue;
+    int pos = count++;
+    for (; pos > 0 && bleScanCache.devices[order[pos - 1]].rssi < bleScanCache.devices[idx].rssi; pos--) order[pos] = order[pos - 1];
+    order[pos] = idx;
+  }
+  for (int n = 0; n < count; n++) memcpy(bleScanCache.listed[n], bleScanCache.devices[order[n]].address, 6);
+  bleScanCache.numListed = count;
+  portEXIT_CRITICAL(&bleScanCache.lock);
+
+  if (count == 0) consolePrint(bleScanCache.scanning ? "Nothing heard yet\n\r" : "No devices cached, run scan first\n\r");
+  else consolePrintf("%-3s %-17s %-24s %5s %8s %6s\n\r", "n", "address", "name", "rssi", "seen ms", "adverts");
+  for (int n = 0; n < count; n++){
+    portENTER_CRITICAL(&bleScanCache.lock);
+    bleDevice_t device = bleScanCache.devices[order[n]]; //copy so the lock isn't held while formatting
+    portEXIT_CRITICAL(&bleScanCache.lock);
+    if (!device.used) continue; //evicted since the sort
+    const uint8_t * a = device.address;
+    consolePrintf("%-3d %02x:%02x:%02x:%02x:%02x:%02x %-24s %5d %8u %6u\n\r", n, a[0], a[1], a[2], a[3], a[4], a[5], device.name,
+      device.rssi >> BLE_RSSI_SHIFT, now - device.lastSeen, device.advertisements);
+  }
+  if (bleScanCache.scanning) consolePrint("(scan still running)\n\r");
+}
+
+/*  Prints what BLE has cost in internal heap: bringing it up, what's still held after the last scan's results were freed,
+*   and what's left after it was shut down
+*
+*/
+inline void printBleScanHeap(){
+  if (bleScanCache.heapBeforeInit == 0){
+    consolePrint("BLE hasn't been up yet, it comes up with the first scan\n\r");
+    return;
+  }
+  consolePrintf("BLE is %s%s\n\r", bleScanCache.releasing ? "shutting down" : ((bleScanCache.scan != NULL) ? "up" : "down"),
+    bleScanCache.controllerReleased ? ", controller memory released" : "");
+  consolePrintf("%-20s %10s %10s\n\r", "internal heap", "free", "ble cost");
+  consolePrintf("%-20s %10u %10s\n\r", "before ble init", bleScanCache.heapBeforeInit, "-");
+  consolePrintf("%-20s %10u %10d\n\r", "after ble init", bleScanCache.heapAfterInit, (int32_t) (bleScanCache.heapBeforeInit - bleScanCache.heapAfterInit));
+  if (bleScanCache.heapAfterScan) consolePrintf("%-20s %10u %10d\n\r", "after last scan", bleScanCache.heapAfterScan, (int32_t) (bleScanCache.heapBeforeInit - bleScanCache.heapAfterScan));
+  if (bleScanCache.heapAfterRelease) consolePrintf("%-20s %10u %10d\n\r", "after release", bleScanCache.heapAfterRelease, (int32_t) (bleScanCache.heapBeforeInit - bleScanCache.heapAfterRelease));
+  consolePrintf("%-20s %10u\n\r", "now", heap_caps_get_free_size(MALLOC_CAP_INTERNAL));
+}
+
+/*  Selects a device from the last "scan list"
+*
+*   @n - position in that list
+*   @return - false if there's no such entry or the device has since been evicted
+*/
+inline bool bleScanSelect(int n){
+  if (n < 0 || n >= bleScanCache.numListed) return false;
+  portENTER_CRITICAL(&bleScanCache.lock);
+  int slot = bleScanFind(bleScanCache.listed[n]);
+  if (slot >= 0){
+    memcpy(bleScanCache.selected, bleScanCache.devices[slot].address, 6);
+    strlcpy(bleScanCache.selectedName, bleScanCache.devices[slot].name, sizeof(bleScanCache.selectedName));
+    bleScanCache.haveSelection = true;
+  }
+  portEXIT_CRITICAL(&bleScanCache.lock);
+  return slot >= 0;
+}
 
-inline BLEScanResults performBLEScan(BLEScan * pBLEScan, int scanTimeSeconds){
-    BLEScanResults foundDevices = pBLEScan->start(scanTimeSeconds, false);
-    pBLEScan->clearResults();   // delete results fromBLEScan buffer to release memory
-    return foundDevices;
-}
\ No newline at end of file
+#endif
@@ -0,0 +1,159 @@
+#ifndef BOOT_H
+#define BOOT_H
+
+#include <Arduino.h>
+#include "static_allocation.h"
+#include "console.h"
+
+#define MAX_BOOT_STEPS (16)
+#define BOOT_ANY_CORE (-1)
+#define BOOT_HELPER_STACK_SIZE (4096)
+#define BOOT_STEP(n) (1u << (n)) //dependency bit for the step at index n of the step list
+
+typedef void (*bootFunction_t)();
+
+typedef enum {
+  BOOT_PENDING,
+  BOOT_RUNNING,
+  BOOT_DONE,
+} bootStepState_t;
+
+/*  One piece of start-up. A step runs once every step in dependsOn has finished, on whichever core is free
+*   (or only on @core). Dependencies must point at earlier steps in the list.
+*/
+typedef struct {
+  const char * name;
+  bootFunction_t function;
+  uint32_t dependsOn; //BOOT_STEP() bits
+  int8_t core; //BOOT_ANY_CORE, or the core the step has to run on (e.g. for its stack size or to pin what it creates)
+} bootStep_t;
+
+typedef struct {
+  const char * name;
+  int8_t core;
+  uint32_t startUs; //micros()
+  uint32_t endUs;
+} bootPhase_t;
+
+/*  Steps run by setup() and a helper task on the other core, plus when each ran. Only boot touches this until it's done,
+*   then it's read-only.
+*/
+typedef struct {
+  const bootStep_t * steps;
+  uint8_t numSteps;
+  volatile bootStepState_t states[MAX_BOOT_STEPS];
+  volatile uint32_t doneMask;
+  bootPhase_t phases[MAX_BOOT_STEPS];
+  uint32_t setupStartUs; //micros() when setup() was entered, i.e. what the boot loader and Arduino core took
+  uint32_t setupEndUs;
+  TaskHandle_t workers[2]; //notified whenever a step finishes
+  TaskHandle_t helper; //runs steps on the core setup() isn't on
+  volatile bool helperDone;
+  portMUX_TYPE lock;
+} bootProfile_t;
+
+extern bootProfile_t bootProfile;
+
+/*  Runs ready steps until every step has finished (setup() and the helper task both run this)
+*
+*   @core - the core the caller is on
+*/
+inline void bootRunSteps(int core){
+  uint32_t allMask = (bootProfile.numSteps >= 32) ? 0xFFFFFFFF : (1u << bootProfile.numSteps) - 1;
+  bootProfile.workers[core] = xTaskGetCurrentTaskHandle();
+
+  while (1){
+    int next = -1;
+    portENTER_CRITICAL(&bootProfile.lock);
+    for (int idx = 0; idx < bootProfile.numSteps; idx++){
+      const bootStep_t & step = bootProfile.steps[idx];
+      if (bootProfile.states[idx] != BOOT_PENDING || (bootProfile.doneMask & step.dependsOn) != step.dependsOn) continue;
+      if (step.core != BOOT_ANY_CORE && step.core != core) continue;
+      bootProfile.states[idx] = BOOT_RUNNING;
+      next = idx;
+      break;
+    }
+    bool finished = (bootProfile.doneMask == allMask);
+    portEXIT_CRITICAL(&bootProfile.lock);
+
+    if (finished) return;
+    if (next < 0){ //everything left is running on the other core or waiting on it
+      ulTaskNotifyTake(pdTRUE, 1);
+      continue;
+    }
+
+    bootPhase_t & phase = bootProfile.phases[next];
+    phase.name = bootProfile.steps[next].name;
+    phase.core = core;
+    phase.startUs = micros();
+    bootProfile.steps[next].function();
+    phase.endUs = micros();
+
+    portENTER_CRITICAL(&bootProfile.lock);
+    bootProfile.states[next] = BOOT_DONE;
+    bootProfile.doneMask |= BOOT_STEP(next);
+    portEXIT_CRITICAL(&bootProfile.lock);
+    for (int worker = 0; worker < 2; worker++) if (bootProfile.workers[worker] != NULL) xTaskNotifyGive(bootProfile.workers[worker]);
+  }
+}
+
+/*  Boot helper task, runs steps on the core setup() isn't using. setup() deletes it once it's done, so nothing can
+*   notify it after it's gone.
+*
+*/
+inline void bootHelperTask(void * params){
+  bootRunSteps(xPortGetCoreID());
+  bootProfile.helperDone = true;
+  vTaskSuspend(NULL);
+}
+
+/*  Runs the start-up steps across both cores and returns once all of them have finished. Call from setup().
+*
+*   @steps - the steps, dependencies pointing at earlier entries
+*   @numSteps - number of steps (at most MAX_BOOT_STEPS)
+*/
+inline void bootRun(const bootStep_t * steps, uint8_t numSteps){
+  bootProfile.steps = steps;
+  bootProfile.numSteps = min(numSteps, (uint8_t) MAX_BOOT_STEPS);
+  bootProfile.doneMask = 0;
+  bootProfile.helperDone = false;
+  bootProfile.lock = portMUX_INITIALIZER_UNLOCKED;
+  for (int idx = 0; idx < MAX_BOOT_STEPS; idx++) bootProfile.states[idx] = BOOT_PENDING;
+
+  int core = xPortGetCoreID();
+  if (createTaskPinned(bootHelperTask, "BOOT HELPER", BOOT_HELPER_STACK_SIZE, NULL, uxTaskPriorityGet(NULL), &bootProfile.helper, 1 - core) != pdPASS){
+    for (int idx = 0; idx < bootProfile.numSteps; idx++){ //no helper, so run the steps in list order here (pinning is ignored)
+      bootPhase_t & phase = bootProfile.phases[idx];
+      phase.name = steps[idx].name;
+      phase.core = core;
+      phase.startUs = micros();
+      steps[idx].function();
+      phase.endUs = micros();
+    }
+  }
+  else {
+    bootRunSteps(core);
+    while (!bootProfile.helperDone) ulTaskNotifyTake(pdTRUE, 1); //the helper may not have noticed everything is done yet
+    vTaskDelete(bootProfile.helper);
+    bootProfile.helper = NULL;
+  }
+  bootProfile.setupEndUs = micros();
+}
+
+/*  Prints when each start-up step ran, on which core, and how much the overlap saved
+*
+*/
+inline void printBootReport(){
+  uint32_t busyUs = 0;
+  consolePrintf("%-20s %4s %10s %10s\n\r", "step", "core", "start ms", "took ms");
+  consolePrintf("%-20s %4s %10s %10u\n\r", "(before setup)", "-", "0", bootProfile.setupStartUs / 1000);
+  for (int idx = 0; idx < bootProfile.numSteps; idx++){
+    const bootPhase_t & phase = bootProfile.phases[idx];
+    busyUs += phase.endUs - phase.startUs;
+    consolePrintf("%-20s %4d %10u %10u\n\r", phase.name, phase.core, phase.startUs / 1000, (phase.endUs - phase.startUs) / 1000);
+  }
+  uint32_t wallUs = bootProfile.setupEndUs - bootProfile.setupStartUs;
+  consolePrintf("setup() took %u ms, the steps add up to %u ms run one after another\n\r", wallUs / 1000, busyUs / 1000);
+}
+
+#endif
@@ -0,0 +1,144 @@
+#ifndef CONSOLE_H
+#define CONSOLE_H
+
+#include <Arduino.h>
+#include <atomic>
+#include <stdarg.h>
+
+#define CONSOLE_RING_SIZE (256) //chunks (power of 2)
+#define CONSOLE_INTERACTIVE_RESERVE (128) //chunks only interactive output (the terminal and jobs) may fill, so logging can't crowd out a table
+#define CONSOLE_CHUNK_SIZE (59) //text bytes per chunk (a chunk is 64 bytes with its header)
+#define CONSOLE_MAX_LINE (256) //longest single consolePrintf() output, anything beyond is cut off
+#define CONSOLE_BATCH_SIZE (512) //bytes the writer task hands to the UART driver at once
+
+typedef enum {
+  CONSOLE_DROP_NEWEST, //text that doesn't fit is thrown away
+  CONSOLE_DROP_OLDEST, //the oldest queued text is thrown away to make room
+} consoleOverflowPolicy_t;
+
+typedef struct {
+  std::atomic<uint32_t> sequence; //slot ownership (bounded MPMC queue sequence number)
+  uint8_t length;
+  char text[CONSOLE_CHUNK_SIZE];
+} consoleChunk_t;
+
+/*  Text waiting to go out on UART0. Any task can queue text without blocking; the console writer task is the only one that
+*   touches the UART. Producers may also act as consumers (to drop the oldest chunk), so both ends are claimed with a CAS.
+*/
+typedef struct {
+  consoleChunk_t chunks[CONSOLE_RING_SIZE];
+  std::atomic<uint32_t> writePos;
+  std::atomic<uint32_t> readPos;
+  std::atomic<uint32_t> droppedBytes;
+  consoleOverflowPolicy_t policy;
+  TaskHandle_t writer; //notified when text is queued
+} console_t;
+
+extern console_t console;
+extern thread_local bool consoleInteractive; //set by tasks whose output the user asked for (the terminal and the job workers), they may use the reserved chunks
+
+/*  Sets every chunk up as free. Must run before any task prints.
+*
+*/
+inline void consoleInit(){
+  for (uint32_t i = 0; i < CONSOLE_RING_SIZE; i++) console.chunks[i].sequence.store(i, std::memory_order_relaxed);
+  console.writePos.store(0, std::memory_order_relaxed);
+  console.readPos.store(0, std::memory_order_relaxed);
+  console.droppedBytes.store(0, std::memory_order_relaxed);
+  console.policy = CONSOLE_DROP_NEWEST;
+  console.writer = NULL;
+}
+
+/*  Takes the oldest chunk off the queue
+*
+*   @out - set to the chunk's text
+*   @length - set to the number of bytes in @out
+*   @return - true if a chunk was available
+*/
+inline bool consoleTake(char * out, uint8_t & length){
+  uint32_t pos = console.readPos.load(std::memory_order_relaxed);
+  consoleChunk_t * chunk;
+  while (1){
+    chunk = &console.chunks[pos & (CONSOLE_RING_SIZE - 1)];
+    int32_t diff = (int32_t) (chunk->sequence.load(std::memory_order_acquire) - (pos + 1));
+    if (diff == 0 && console.readPos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) break;
+    if (diff < 0) return false; //empty
+    if (diff > 0) pos = console.readPos.load(std::memory_order_relaxed);
+  }
+  length = chunk->length;
+  memcpy(out, chunk->text, length);
+  chunk->sequence.store(pos + CONSOLE_RING_SIZE, std::memory_order_release); //hand the chunk back to producers
+  return true;
+}
+
+/*  Queues one chunk's worth of text, applying the overflow policy if the queue is full. Never waits. Tasks that don't set
+*   consoleInteractive see the queue as full CONSOLE_INTERACTIVE_RESERVE chunks early, so log bursts can't take the room
+*   a command's output needs.
+*
+*   @text - the text
+*   @length - at most CONSOLE_CHUNK_SIZE bytes
+*   @return - false if the text was dropped
+*/
+inline bool consolePut(const char * text, uint8_t length){
+  uint32_t pos = console.writePos.load(std::memory_order_relaxed);
+  consoleChunk_t * chunk;
+  char discard[CONSOLE_CHUNK_SIZE];
+  uint8_t discardLength;
+  int32_t limit = consoleInteractive ? CONSOLE_RING_SIZE : CONSOLE_RING_SIZE - CONSOLE_INTERACTIVE_RESERVE;
+  while (1){
+    chunk = &console.chunks[pos & (CONSOLE_RING_SIZE - 1)];
+    int32_t diff = (int32_t) (chunk->sequence.load(std::memory_order_acquire) - pos);
+    bool full = (diff < 0) || ((int32_t) (pos - console.readPos.load(std::memory_order_relaxed)) >= limit);
+    if (!full && diff == 0 && console.writePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) break;
+    if (full){
+      if (console.policy == CONSOLE_DROP_NEWEST || !consoleTake(discard, discardLength)){
+        console.droppedBytes.fetch_add(length, std::memory_order_relaxed);
+        return false;
+      }
+      console.droppedBytes.fetch_add(discardLength, std::memory_order_relaxed);
+    }
+    pos = console.writePos.load(std::memory_order_relaxed);
+  }
+  chunk->length = length;
+  memcpy(chunk->text, text, length);
+  chunk->sequence.store(pos + 1, std::memory_order_release); //publish
+  return true;
+}
+
+/*  Queues text for the console without blocking
+*
+*   @text - the text
+*   @length - number of bytes
+*/
+inline void consoleWrite(const char * text, size_t length){
+  while (length > 0){
+    uint8_t part = min(length, (size_t) CONSOLE_CHUNK_SIZE);
+    consolePut(text, part);
+    text += part;
+    length -= part;
+  }
+  if (console.writer != NULL) xTaskNotifyGive(console.writer);
+}
+
+/*  Queues a string for the console
+*
+*   @text - null terminated string
+*/
+inline void consolePrint(const char * text){
+  consoleWrite(text, strlen(text));
+}
+
+/*  Formats text and queues it for the console
+*
+*   @format - printf format string
+*/
+inline void consolePrintf(const char * format, ...){
+  char line[CONSOLE_MAX_LINE];
+  va_list args;
+  va_start(args, format);
+  int length = vsnprintf(line, sizeof(line), format, args);
+  va_end(args);
+  if (length > 0) consoleWrite(line, min((size_t) length, sizeof(line) - 1));
+}
+
+#endif
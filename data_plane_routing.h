@@ -0,0 +1,176 @@
+#ifndef DATA_PLANE_ROUTING_H
+#define DATA_PLANE_ROUTING_H
+
+#include <BlueteethInternalNetworkStack.h>
+#include "slave_table.h"
+#include "console.h"
+
+//Channel masks used by the routing table (A2DP delivers interleaved 16 bit stereo)
+#define CHANNEL_LEFT (1 << 0)
+#define CHANNEL_RIGHT (1 << 1)
+#define CHANNEL_BOTH (CHANNEL_LEFT | CHANNEL_RIGHT)
+#define BYTES_PER_SAMPLE (2)
+#define NUM_STREAM_CHANNELS (2)
+#define STEREO_FRAME_BYTES (BYTES_PER_SAMPLE * NUM_STREAM_CHANNELS)
+
+//Data plane frame types. Every burst handed to streamData starts with one of these headers.
+#define DATA_PLANE_UNICAST (0xA1) //[type][destination address][channel mask][samples for those channels...]
+#define DATA_PLANE_BROADCAST (0xA2) //[type][slave count][2 bit channel mask per slave...][interleaved stereo samples...]
+#define DATA_PLANE_TAGGED (0x08) //frame type flag: a one byte latency tag follows the header
+#define DATA_PLANE_PADDED (0x04) //frame type flag: zeros were added to fill the last payload, the last byte counts the zeros before it
+#define UNICAST_HEADER_SIZE (3)
+#define BROADCAST_HEADER_SIZE(numEntries) (2 + ((numEntries) + 3) / 4)
+#define LATENCY_TAG_SIZE (1)
+#define MAX_DATA_PLANE_HEADER_SIZE (BROADCAST_HEADER_SIZE(MAX_SLAVES) + LATENCY_TAG_SIZE)
+#define MAX_DATA_PLANE_PADDING (PAYLOAD_SIZE - 1)
+
+typedef struct {
+  uint8_t channelMask[MAX_SLAVES]; //channels each slave plays, indexed like the slave table
+} routingTable_t;
+
+/*  Points every slave at both channels (what the master did before routing existed)
+*
+*   @routing - the routing table being reset
+*/
+inline void resetRoutingTable(routingTable_t & routing){
+  memset(routing.channelMask, CHANNEL_BOTH, sizeof(routing.channelMask));
+}
+
+/*  Gets the number of slave table entries a broadcast header has to describe (highest populated index + 1)
+*
+*   @table - the slave table
+*/
+inline int routedEntries(const slaveTable_t & table){
+  return slaveEntries(table);
+}
+
+/*  Gets the number of bytes a channel mask selects out of a block of stereo samples
+*
+*   @mask - channel mask
+*   @sampleBytes - number of interleaved stereo bytes
+*/
+inline size_t maskedLength(uint8_t mask, size_t sampleBytes){
+  if ((mask & CHANNEL_BOTH) == CHANNEL_BOTH) return sampleBytes;
+  if (mask & CHANNEL_BOTH) return sampleBytes / NUM_STREAM_CHANNELS;
+  return 0;
+}
+
+/*  Decides whether a block of samples is cheaper to send once to everyone or once per subscribed slave.
+*
+*   @routing - the routing table
+*   @table - the slave table
+*   @sampleBytes - number of interleaved stereo bytes being sent
+*   @return - true if a single broadcast frame puts fewer bytes on the wire
+*/
+inline bool shouldBroadcast(const routingTable_t & routing, const slaveTable_t & table, size_t sampleBytes){
+  int entries = routedEntries(table);
+  if (entries == 0) return true; //nothing enumerated, so everyone gets everything
+
+  size_t unicastBytes = 0;
+  for (int idx = 0; idx < entries; idx++){
+    if (!slavePresent(table, idx)) continue;
+    size_t len = maskedLength(routing.channelMask[idx], sampleBytes);
+    if (len) unicastBytes += UNICAST_HEADER_SIZE + len;
+  }
+  return (BROADCAST_HEADER_SIZE(entries) + sampleBytes) <= unicastBytes;
+}
+
+/*  Writes a broadcast header carrying every slave's channel mask
+*
+*   @header - output (at least MAX_DATA_PLANE_HEADER_SIZE bytes)
+*   @routing - the routing table
+*   @table - the slave table
+*   @tag - latency tag to attach, or -1 for none
+*   @return - number of header bytes written
+*/
+inline size_t buildBroadcastHeader(uint8_t * header, const routingTable_t & routing, const slaveTable_t & table, int tag = -1){
+  int entries = routedEntries(table);
+  size_t len = BROADCAST_HEADER_SIZE(entries);
+  memset(header, 0, len);
+  header[0] = DATA_PLANE_BROADCAST;
+  header[1] = entries;
+  for (int idx = 0; idx < entries; idx++){
+    uint8_t mask = slavePresent(table, idx) ? (routing.channelMask[idx] & CHANNEL_BOTH) : 0;
+    header[2 + idx / 4] |= mask << ((idx % 4) * 2);
+  }
+  if (tag >= 0){
+    header[0] |= DATA_PLANE_TAGGED;
+    header[len++] = tag;
+  }
+  return len;
+}
+
+/*  Appends a broadcast frame (header + every stereo sample) to a staging buffer
+*
+*   @out - staging buffer the frame is appended to
+*   @header - header from buildBroadcastHeader()
+*   @headerLen - number of header bytes
+*   @in - interleaved stereo samples
+*   @sampleBytes - number of bytes of @in to use (multiple of STEREO_FRAME_BYTES)
+*/
+inline void appendBroadcastFrame(std::deque<uint8_t> & out, const uint8_t * header, size_t headerLen, const uint8_t * in, size_t sampleBytes){
+  out.insert(out.end(), header, header + headerLen);
+  out.insert(out.end(), in, in + sampleBytes);
+}
+
+/*  Appends a unicast frame (header + the slave's channels) to a staging buffer
+*
+*   @out - staging buffer the frame is appended to
+*   @in - interleaved stereo samples
+*   @sampleBytes - number of bytes of @in to use (multiple of STEREO_FRAME_BYTES)
+*   @address - destination slave
+*   @mask - channels the slave wants
+*   @tag - latency tag to attach, or -1 for none
+*/
+inline void appendUnicastFrame(std::deque<uint8_t> & out, const uint8_t * in, size_t sampleBytes, uint8_t address, uint8_t mask, int tag = -1){
+  out.push_back((tag < 0) ? DATA_PLANE_UNICAST : (DATA_PLANE_UNICAST | DATA_PLANE_TAGGED));
+  out.push_back(address);
+  out.push_back(mask);
+  if (tag >= 0) out.push_back(tag);
+  for (size_t i = 0; i < sampleBytes; i += STEREO_FRAME_BYTES){
+    if (mask & CHANNEL_LEFT){
+      out.push_back(in[i]);
+      out.push_back(in[i + 1]);
+    }
+    if (mask & CHANNEL_RIGHT){
+      out.push_back(in[i + 2]);
+      out.push_back(in[i + 3]);
+    }
+  }
+}
+
+/*  Gets the size of a frame once padFrame() has filled it out
+*
+*   @len - unpadded frame length, header included
+*/
+inline size_t paddedFrameSize(size_t len){
+  return (len + PAYLOAD_SIZE - 1) / PAYLOAD_SIZE * PAYLOAD_SIZE;
+}
+
+/*  Fills a staged frame out to a whole number of PAYLOAD_SIZE payloads, since packDataStream only packs whole payloads.
+*   The frame is flagged and its last byte says how many zeros come before it, so the slave can strip them exactly.
+*
+*   @frame - staging buffer holding one frame, header first
+*/
+inline void padFrame(std::deque<uint8_t> & frame){
+  size_t pad = paddedFrameSize(frame.size()) - frame.size();
+  if (pad == 0) return;
+  frame.front() |= DATA_PLANE_PADDED;
+  frame.insert(frame.end(), pad - 1, 0);
+  frame.push_back(pad - 1);
+}
+
+/*  Prints the channel routing of every slave in the table
+*
+*   @routing - the routing table
+*   @table - the slave table
+*/
+inline void printRoutingTable(const routingTable_t & routing, const slaveTable_t & table){
+  const char * names[] = {"none", "left", "right", "both"};
+  for (int idx = 0; idx < slaveEntries(table); idx++){
+    if (!slavePresent(table, idx)) continue;
+    consolePrintf("ADDR%d: %s\n\r", table.slaves[idx].address, names[routing.channelMask[idx] & CHANNEL_BOTH]);
+  }
+}
+
+#endif
\ No newline at end of file
@@ -0,0 +1,219 @@
+#ifndef FAST_RECONNECT_H
+#define FAST_RECONNECT_H
+
+#include <Arduino.h>
+#include <Preferences.h>
+#include "slave_table.h"
+#include "bluetooth_scanning.h"
+#include "static_allocation.h"
+#include "jobs.h"
+#include "console.h"
+#include "logging.h"
+
+#define PERSIST_NAMESPACE "blueteeth"
+#define PERSIST_KEY "state"
+#define PERSIST_VERSION (2) //bump when persistedState_t changes so an old record is ignored instead of misread
+
+/*  What the master remembers across resets. The A2DP library reconnects to the last source itself (auto reconnect); its
+*   address and the sample rate it negotiated are kept here too, so pacing starts at the right rate before the codec
+*   configuration comes in again.
+*
+*/
+typedef struct {
+  uint8_t version; //0 once cleared, the record is then removed from NVS
+  uint8_t numSlaves;
+  slaveInfo_t slaves[MAX_SLAVES]; //address, channels, codecs and baud of every slave, as reported at enumeration
+  char connectName[BLE_SCAN_NAME_SIZE]; //device the slaves were last told to connect to
+  uint8_t a2dpPeer[6]; //Bluetooth address of the last A2DP source
+  uint16_t a2dpSampleRate; //Hz, negotiated with that source (SBC), 0 until one has connected
+} persistedState_t;
+
+typedef struct {
+  persistedState_t saved; //what's in NVS (as loaded at boot, then as last written)
+  bool restored; //NVS held a valid record at boot
+  volatile bool connectPending; //send CONNECT as soon as the ring matches the saved topology
+  uint32_t ringReadyMs; //millis() when enumeration finished after boot, 0 until then
+  uint32_t a2dpConnectedMs; //millis() when the A2DP source first connected, 0 until then
+  uint32_t firstAudioMs; //millis() when the first frame went out on the data plane, 0 until then
+  volatile bool savePending; //a save job is queued and will pick up every change made before it runs
+  portMUX_TYPE lock; //saved is changed by the reception task and the terminal while the save job copies it
+} fastReconnect_t;
+
+extern fastReconnect_t fastReconnect;
+
+/*  Background job that writes the saved state to NVS (or removes it once cleared). NVS writes erase flash and Preferences
+*   allocates, so neither the reception task nor the terminal does it inline.
+*
+*   @job - the running job
+*/
+inline void fastReconnectSaveJob(job_t & job){
+  persistedState_t snapshot;
+  portENTER_CRITICAL(&fastReconnect.lock);
+  fastReconnect.savePending = false; //changes from here on queue another save
+  snapshot = fastReconnect.saved;
+  portEXIT_CRITICAL(&fastReconnect.lock);
+
+  HEAP_EXEMPT(); //the NVS layer allocates its handle and page cache
+  Preferences preferences;
+  if (!preferences.begin(PERSIST_NAMESPACE, false)){
+    LOG_WARN("NVS unavailable, state not saved");
+    return;
+  }
+  if (snapshot.version == 0) preferences.remove(PERSIST_KEY);
+  else preferences.putBytes(PERSIST_KEY, &snapshot, sizeof(snapshot));
+  preferences.end();
+}
+
+/*  Queues a write of the saved state, unless one is already waiting to run
+*
+*/
+inline void fastReconnectSave(){
+  portENTER_CRITICAL(&fastReconnect.lock);
+  bool submit = !fastReconnect.savePending;
+  fastReconnect.savePending = true;
+  portEXIT_CRITICAL(&fastReconnect.lock);
+  if (submit && jobSubmit("nvs save", fastReconnectSaveJob) < 0){
+    fastReconnect.savePending = false;
+    LOG_WARN("Job queue full, state not saved");
+  }
+}
+
+/*  Loads the saved state from NVS. Must run before enumeration starts.
+*
+*/
+inline void fastReconnectInit(){
+  memset(&fastReconnect, 0, sizeof(fastReconnect));
+  fastReconnect.lock = portMUX_INITIALIZER_UNLOCKED;
+  Preferences preferences;
+  if (!preferences.begin(PERSIST_NAMESPACE, true)) return; //nothing saved yet (the namespace doesn't exist)
+  fastReconnect.restored = (preferences.getBytesLength(PERSIST_KEY) == sizeof(fastReconnect.saved))
+    && (preferences.getBytes(PERSIST_KEY, &fastReconnect.saved, sizeof(fastReconnect.saved)) == sizeof(fastReconnect.saved))
+    && (fastReconnect.saved.version == PERSIST_VERSION);
+  preferences.end();
+  if (!fastReconnect.restored) memset(&fastReconnect.saved, 0, sizeof(fastReconnect.saved));
+  fastReconnect.connectPending = fastReconnect.restored && fastReconnect.saved.numSlaves > 0;
+}
+
+/*  Forgets the saved state, in NVS and in RAM
+*
+*/
+inline void fastReconnectClear(){
+  portENTER_CRITICAL(&fastReconnect.lock);
+  memset(&fastReconnect.saved, 0, sizeof(fastReconnect.saved));
+  portEXIT_CRITICAL(&fastReconnect.lock);
+  fastReconnect.restored = false;
+  fastReconnect.connectPending = false;
+  fastReconnectSave();
+}
+
+/*  Gets the name the slaves should connect to: the device picked with "select", else the one they connected to last time
+*
+*/
+inline const char * fastReconnectName(){
+  if (bleScanCache.haveSelection && bleScanCache.selectedName[0]) return bleScanCache.selectedName;
+  if (fastReconnect.saved.connectName[0]) return fastReconnect.saved.connectName;
+  return "Wireless Speaker";
+}
+
+/*  Remembers the name the slaves were told to connect to
+*
+*   @name - the device name
+*/
+inline void fastReconnectConnecting(const char * name){
+  if (0 == strcmp(name, fastReconnect.saved.connectName)) return; //NVS writes are slow and wear the flash, skip unchanged ones
+  portENTER_CRITICAL(&fastReconnect.lock);
+  strlcpy(fastReconnect.saved.connectName, name, sizeof(fastReconnect.saved.connectName));
+  fastReconnect.saved.version = PERSIST_VERSION;
+  portEXIT_CRITICAL(&fastReconnect.lock);
+  fastReconnectSave();
+}
+
+/*  Compares the ring with the saved topology
+*
+*   @table - the slave table
+*/
+inline bool fastReconnectTopologyMatches(const slaveTable_t & table){
+  if (table.numSlaves != fastReconnect.saved.numSlaves) return false;
+  for (int idx = 0; idx < MAX_SLAVES; idx++){
+    const slaveInfo_t & live = table.slaves[idx];
+    const slaveInfo_t & saved = fastReconnect.saved.slaves[idx];
+    if (live.address != saved.address || live.channels != saved.channels || live.codecs != saved.codecs || live.maxBaud != saved.maxBaud) return false;
+  }
+  return true;
+}
+
+/*  Called whenever the slave table changes during enumeration. Once every slave has reported, saves the topology if it changed.
+*
+*   @table - the slave table
+*   @return - true if the slaves should be sent CONNECT now (the ring came back as it was before the reset)
+*/
+inline bool fastReconnectRingUpdated(const slaveTable_t & table){
+  if (table.expectedSlaves == 0 || table.numSlaves != table.expectedSlaves) return false;
+  if (fastReconnect.ringReadyMs == 0) fastReconnect.ringReadyMs = millis();
+
+  bool matches = fastReconnectTopologyMatches(table);
+  if (!matches){
+    portENTER_CRITICAL(&fastReconnect.lock);
+    fastReconnect.saved.numSlaves = table.numSlaves;
+    memcpy(fastReconnect.saved.slaves, table.slaves, sizeof(fastReconnect.saved.slaves));
+    fastReconnect.saved.version = PERSIST_VERSION;
+    portEXIT_CRITICAL(&fastReconnect.lock);
+    fastReconnectSave();
+  }
+  if (!fastReconnect.connectPending) return false;
+  fastReconnect.connectPending = false;
+  if (!matches) LOG_INFO("Ring changed since the last boot, connect by hand");
+  return matches;
+}
+
+/*  Records when the A2DP source connected, and remembers which source it was
+*
+*   @peer - the source's Bluetooth address
+*/
+inline void fastReconnectA2dpConnected(const uint8_t * peer){
+  if (fastReconnect.a2dpConnectedMs == 0) fastReconnect.a2dpConnectedMs = millis();
+  if (0 == memcmp(peer, fastReconnect.saved.a2dpPeer, sizeof(fastReconnect.saved.a2dpPeer))) return; //skip unchanged writes
+  portENTER_CRITICAL(&fastReconnect.lock);
+  memcpy(fastReconnect.saved.a2dpPeer, peer, sizeof(fastReconnect.saved.a2dpPeer));
+  fastReconnect.saved.version = PERSIST_VERSION;
+  portEXIT_CRITICAL(&fastReconnect.lock);
+  fastReconnectSave();
+}
+
+/*  Remembers the sample rate the source negotiated
+*
+*   @rate - sample rate in Hz
+*/
+inline void fastReconnectSampleRate(uint16_t rate){
+  if (rate == fastReconnect.saved.a2dpSampleRate) return;
+  portENTER_CRITICAL(&fastReconnect.lock);
+  fastReconnect.saved.a2dpSampleRate = rate;
+  fastReconnect.saved.version = PERSIST_VERSION;
+  portEXIT_CRITICAL(&fastReconnect.lock);
+  fastReconnectSave();
+}
+
+/*  Records the first frame on the data plane (the end of boot-to-audio)
+*
+*/
+inline void fastReconnectFirstAudio(){
+  if (fastReconnect.firstAudioMs != 0) return;
+  fastReconnect.firstAudioMs = millis();
+  LOG_INFO("First audio on the data plane %u ms after reset", fastReconnect.firstAudioMs); //formatted by the console writer, not on the packager's stack
+}
+
+/*  Prints the saved state and how long this boot took to get to each milestone
+*
+*/
+inline void printFastReconnect(){
+  const uint8_t * peer = fastReconnect.saved.a2dpPeer;
+  consolePrintf("Saved state: %s, %u slave(s), connect name \"%s\"\n\r", fastReconnect.restored ? "restored at boot" : "none at boot",
+    fastReconnect.saved.numSlaves, fastReconnect.saved.connectName);
+  consolePrintf("A2DP source %02x:%02x:%02x:%02x:%02x:%02x at %u Hz\n\r", peer[0], peer[1], peer[2], peer[3], peer[4], peer[5], fastReconnect.saved.a2dpSampleRate);
+  consolePrintf("%-20s %10s\n\r", "milestone", "ms");
+  consolePrintf("%-20s %10u\n\r", "ring ready", fastReconnect.ringReadyMs);
+  consolePrintf("%-20s %10u\n\r", "a2dp connected", fastReconnect.a2dpConnectedMs);
+  consolePrintf("%-20s %10u\n\r", "first audio", fastReconnect.firstAudioMs);
+}
+
+#endif
@@ -0,0 +1,197 @@
+#ifndef FLOW_CONTROL_H
+#define FLOW_CONTROL_H
+
+#include <BlueteethInternalNetworkStack.h>
+#include <esp_timer.h>
+#include "slave_table.h"
+#include "data_plane_routing.h"
+#include "console.h"
+
+#define FLOW_CONTROL_BURST_SIZE (1024) //largest block of samples sent at once while pacing against credits
+#define FLOW_CONTROL_RETRY_MS (2) //how long the packager backs off when it runs out of credits
+#define FLOW_CONTROL_FRAME_OVERHEAD (MAX_DATA_PLANE_HEADER_SIZE + MAX_DATA_PLANE_PADDING) //most a slave is charged on top of its samples for one frame
+#define FLOW_CONTROL_STREAM_RATE (44100 * STEREO_FRAME_BYTES) //bytes per second A2DP delivers until a sample rate is known (44.1 kHz 16 bit stereo)
+#define FLOW_CONTROL_CATCH_UP (2) //paced chunks go out at up to this multiple of the playback rate, so a drained buffer still refills
+
+/*  Credit state for every slave in the slave table.
+*   Slaves advertise a running total of bytes they can accept (bytes played out + playback buffer size), so credits
+*   are simply that limit minus what the master has sent. Packets in flight can't cause double counting that way.
+*   Every byte of a frame a slave keeps counts against its credits: its channels of the samples, the header, the latency tag
+*   and the padding. Slaves that have never advertised credits aren't paced. While any slave is paced, chunks are spaced out
+*   so they arrive at FLOW_CONTROL_CATCH_UP times the playback rate instead of back to back.
+*/
+typedef struct {
+  uint32_t creditLimit[MAX_SLAVES];
+  uint32_t bytesSent[MAX_SLAVES];
+  bool creditsKnown[MAX_SLAVES];
+  bool paced; //the last length from creditLimitedLength() was limited by credits
+  int64_t nextChunkTime; //esp_timer_get_time() before which the next paced chunk waits
+  uint32_t streamRate; //bytes per second A2DP delivers, from the negotiated (or last saved) sample rate
+  volatile uint32_t starvationCount; //number of times the packager had data but no slave credits to send it with
+  portMUX_TYPE lock; //the packager, the reception task and the terminal all use the credits
+} flowControl_t;
+
+/*  Forgets all credits (slaves start from zero after a new enumeration)
+*
+*   @flow - flow control state being reset
+*/
+inline void resetFlowControl(flowControl_t & flow){
+  portENTER_CRITICAL(&flow.lock);
+  memset(flow.creditLimit, 0, sizeof(flow.creditLimit));
+  memset(flow.bytesSent, 0, sizeof(flow.bytesSent));
+  memset(flow.creditsKnown, 0, sizeof(flow.creditsKnown));
+  flow.paced = false;
+  flow.nextChunkTime = 0;
+  flow.starvationCount = 0;
+  portEXIT_CRITICAL(&flow.lock);
+}
+
+/*  Sets up the lock and forgets all credits. Called once at boot, before anything else uses the state.
+*
+*   @flow - flow control state
+*/
+inline void initFlowControl(flowControl_t & flow){
+  flow.lock = portMUX_INITIALIZER_UNLOCKED;
+  flow.streamRate = FLOW_CONTROL_STREAM_RATE;
+  resetFlowControl(flow);
+}
+
+/*  Sets the playback rate paced chunks are spaced out against
+*
+*   @flow - flow control state
+*   @sampleRate - A2DP sample rate in Hz (16 bit stereo)
+*/
+inline void flowControlSetSampleRate(flowControl_t & flow, uint32_t sampleRate){
+  if (sampleRate == 0) return;
+  portENTER_CRITICAL(&flow.lock);
+  flow.streamRate = sampleRate * STEREO_FRAME_BYTES;
+  portEXIT_CRITICAL(&flow.lock);
+}
+
+/*  Records a credit advertisement from a slave
+*
+*   @flow - flow control state
+*   @idx - slave table index of the slave
+*   @limit - running total of bytes the slave can accept
+*/
+inline void grantCredits(flowControl_t & flow, int idx, uint32_t limit){
+  portENTER_CRITICAL(&flow.lock);
+  flow.creditLimit[idx] = limit;
+  flow.creditsKnown[idx] = true;
+  portEXIT_CRITICAL(&flow.lock);
+}
+
+/*  Gets the number of bytes a slave can currently accept. The caller holds flow.lock.
+*
+*   @flow - flow control state
+*   @idx - slave table index of the slave
+*   @return - available credits, or SIZE_MAX if the slave isn't paced
+*/
+inline size_t availableCredits(const flowControl_t & flow, int idx){
+  if (!flow.creditsKnown[idx]) return SIZE_MAX;
+  int32_t credits = (int32_t) (flow.creditLimit[idx] - flow.bytesSent[idx]); //wrap-safe difference
+  return (credits > 0) ? credits : 0;
+}
+
+/*  Gets the number of bytes a slave is charged for one frame: its channels of the samples plus the frame's header, latency
+*   tag and padding
+*
+*   @mask - channels the slave plays
+*   @sampleBytes - interleaved stereo bytes the frame was built from
+*   @headerLen - header bytes of the frame, latency tag included
+*   @broadcast - true for a broadcast frame (carries every channel), false for the slave's own unicast frame
+*/
+inline size_t frameCost(uint8_t mask, size_t sampleBytes, size_t headerLen, bool broadcast){
+  size_t samples = maskedLength(mask, sampleBytes);
+  size_t carried = broadcast ? sampleBytes : samples;
+  return samples + paddedFrameSize(headerLen + carried) - carried;
+}
+
+/*  Limits a block of stereo samples to what every subscribed slave has credits for, leaving room for the largest frame
+*   overhead since the frame type isn't decided yet
+*
+*   @flow - flow control state
+*   @routing - routing table (decides how many bytes of the block each slave receives)
+*   @table - slave table
+*   @sampleBytes - number of interleaved stereo bytes ready to send
+*   @return - number of stereo bytes that can be sent (multiple of STEREO_FRAME_BYTES)
+*/
+inline size_t creditLimitedLength(flowControl_t & flow, const routingTable_t & routing, const slaveTable_t & table, size_t sampleBytes){
+  size_t allowed = sampleBytes;
+  bool paced = false;
+  portENTER_CRITICAL(&flow.lock);
+  for (int idx = 0; idx < slaveEntries(table); idx++){
+    if (!slavePresent(table, idx) || !flow.creditsKnown[idx]) continue;
+    size_t share = maskedLength(routing.channelMask[idx], STEREO_FRAME_BYTES);
+    if (share == 0) continue;
+    paced = true;
+    size_t credits = availableCredits(flow, idx);
+    credits = (credits > FLOW_CONTROL_FRAME_OVERHEAD) ? credits - FLOW_CONTROL_FRAME_OVERHEAD : 0;
+    allowed = min(allowed, credits / share * STEREO_FRAME_BYTES);
+  }
+  flow.paced = paced;
+  portEXIT_CRITICAL(&flow.lock);
+  if (paced) allowed = min(allowed, (size_t) FLOW_CONTROL_BURST_SIZE); //send in small steps instead of full data plane payloads
+  return (allowed / STEREO_FRAME_BYTES) * STEREO_FRAME_BYTES;
+}
+
+/*  Gets how long the packager has to wait before sending the next chunk, so paced chunks are spread out rather than sent back to back
+*
+*   @flow - flow control state
+*   @return - ticks to wait, 0 to send now
+*/
+inline TickType_t pacingDelay(flowControl_t & flow){
+  if (!flow.paced) return 0;
+  int64_t wait = flow.nextChunkTime - esp_timer_get_time();
+  if (wait <= 0) return 0;
+  return (wait + portTICK_PERIOD_MS * 1000 - 1) / (portTICK_PERIOD_MS * 1000);
+}
+
+/*  Counts a burst the packager had data for but no credits to send
+*
+*   @flow - flow control state
+*/
+inline void flowControlStarved(flowControl_t & flow){
+  portENTER_CRITICAL(&flow.lock);
+  flow.starvationCount++;
+  portEXIT_CRITICAL(&flow.lock);
+}
+
+/*  Charges a sent frame against every slave that keeps part of it, and schedules the next paced chunk
+*
+*   @flow - flow control state
+*   @routing - routing table
+*   @table - slave table
+*   @sampleBytes - number of interleaved stereo bytes that were sent
+*   @headerLen - header bytes of each frame, latency tag included
+*   @broadcast - true if one broadcast frame was sent, false if each slave got a unicast frame
+*/
+inline void consumeCredits(flowControl_t & flow, const routingTable_t & routing, const slaveTable_t & table, size_t sampleBytes, size_t headerLen, bool broadcast){
+  portENTER_CRITICAL(&flow.lock);
+  for (int idx = 0; idx < slaveEntries(table); idx++){
+    if (!slavePresent(table, idx) || maskedLength(routing.channelMask[idx], sampleBytes) == 0) continue;
+    flow.bytesSent[idx] += frameCost(routing.channelMask[idx], sampleBytes, headerLen, broadcast);
+  }
+  if (flow.paced) flow.nextChunkTime = esp_timer_get_time() + (int64_t) sampleBytes * 1000000 / (flow.streamRate * FLOW_CONTROL_CATCH_UP);
+  portEXIT_CRITICAL(&flow.lock);
+}
+
+/*  Prints the credits available for every slave and the starvation count
+*
+*   @flow - flow control state
+*   @table - slave table
+*/
+inline void printFlowControl(flowControl_t & flow, const slaveTable_t & table){
+  for (int idx = 0; idx < slaveEntries(table); idx++){
+    if (!slavePresent(table, idx)) continue;
+    portENTER_CRITICAL(&flow.lock);
+    bool known = flow.creditsKnown[idx];
+    size_t credits = availableCredits(flow, idx);
+    portEXIT_CRITICAL(&flow.lock);
+    if (known) consolePrintf("ADDR%d: %u credits\n\r", table.slaves[idx].address, credits);
+    else consolePrintf("ADDR%d: not paced\n\r", table.slaves[idx].address);
+  }
+  consolePrintf("Credit starvation count: %u\n\r", flow.starvationCount);
+}
+
+#endif
\ No newline at end of file
@@ -0,0 +1,201 @@
+#ifndef JOBS_H
+#define JOBS_H
+
+#include <Arduino.h>
+#include "static_allocation.h"
+#include "console.h"
+
+#define MAX_JOBS (8) //jobs remembered at once (queued, running or finished)
+#define JOB_WORKERS (2) //jobs that can run at the same time
+#define JOB_LOCK_POLL_MS (10) //how often a job waiting for the data plane checks whether it was killed
+
+typedef enum {
+  JOB_FREE,
+  JOB_QUEUED,
+  JOB_RUNNING,
+  JOB_FINISHED,
+  JOB_KILLED,
+} jobState_t;
+
+struct job_t;
+typedef void (*jobFunction_t)(job_t & job);
+
+/*  A long-running terminal command. The job function reports progress and checks jobCancelled() at convenient points,
+*   so "kill" stops it cleanly instead of tearing the task down mid-operation.
+*/
+typedef struct job_t {
+  uint16_t id;
+  const char * name;
+  jobFunction_t function;
+  volatile jobState_t state;
+  volatile bool killRequested;
+  volatile uint32_t progress; //units are up to the job, progress / total is the fraction done
+  volatile uint32_t total;
+  uint32_t startTime; //millis()
+  uint32_t endTime;
+} job_t;
+
+typedef struct {
+  job_t jobs[MAX_JOBS];
+  uint16_t nextId;
+  QueueHandle_t queue; //indexes of queued jobs, in submission order
+  uint8_t queueStorage[MAX_JOBS];
+  StaticQueue_t queueBuffer;
+  SemaphoreHandle_t dataPlane; //held by jobs that fill the data stream, so they run back to back instead of mixing their data
+  StaticSemaphore_t dataPlaneBuffer;
+  portMUX_TYPE lock;
+} jobRunner_t;
+
+extern jobRunner_t jobRunner;
+
+/*  Sets up the job table and queue. Must run before the workers start.
+*
+*/
+inline void jobRunnerInit(){
+  memset(jobRunner.jobs, 0, sizeof(jobRunner.jobs));
+  jobRunner.nextId = 1;
+  jobRunner.queue = createQueue(MAX_JOBS, sizeof(uint8_t), jobRunner.queueStorage, &jobRunner.queueBuffer);
+  jobRunner.dataPlane = createMutex(&jobRunner.dataPlaneBuffer);
+  jobRunner.lock = portMUX_INITIALIZER_UNLOCKED;
+}
+
+/*  Queues a job for the worker pool. Finished jobs are forgotten (oldest first) to make room.
+*
+*   @name - shown by the "jobs" command (must be a literal)
+*   @function - the work to do
+*   @return - the job's id, or -1 if every slot holds a queued or running job
+*/
+inline int jobSubmit(const char * name, jobFunction_t function){
+  int slot = -1;
+  portENTER_CRITICAL(&jobRunner.lock);
+  for (int idx = 0; idx < MAX_JOBS; idx++){
+    jobState_t state = jobRunner.jobs[idx].state;
+    if (state == JOB_FREE){
+      slot = idx;
+      break;
+    }
+    if ((state == JOB_FINISHED || state == JOB_KILLED) && (slot < 0 || jobRunner.jobs[idx].id < jobRunner.jobs[slot].id)) slot = idx;
+  }
+  if (slot >= 0){
+    job_t & job = jobRunner.jobs[slot];
+    job.id = jobRunner.nextId++;
+    job.name = name;
+    job.function = function;
+    job.state = JOB_QUEUED;
+    job.killRequested = false;
+    job.progress = 0;
+    job.total = 0;
+    job.startTime = 0;
+    job.endTime = 0;
+  }
+  portEXIT_CRITICAL(&jobRunner.lock);
+
+  if (slot < 0) return -1;
+  uint8_t idx = slot;
+  xQueueSend(jobRunner.queue, &idx, 0); //can't fail, the queue holds as many entries as there are slots
+  return jobRunner.jobs[slot].id;
+}
+
+/*  Asks a queued or running job to stop
+*
+*   @id - the job's id
+*   @return - false if there's no such job or it already ended
+*/
+inline bool jobKill(uint16_t id){
+  bool found = false;
+  portENTER_CRITICAL(&jobRunner.lock); //so the slot can't be reused by jobSubmit or finish between the check and the request
+  for (int idx = 0; idx < MAX_JOBS && !found; idx++){
+    job_t & job = jobRunner.jobs[idx];
+    if (job.id == id && (job.state == JOB_QUEUED || job.state == JOB_RUNNING)){
+      job.killRequested = true;
+      found = true;
+    }
+  }
+  portEXIT_CRITICAL(&jobRunner.lock);
+  return found;
+}
+
+/*  Checks whether a job is still queued or running
+*
+*   @id - the job's id
+*/
+inline bool jobActive(int id){
+  bool active = false;
+  portENTER_CRITICAL(&jobRunner.lock);
+  for (int idx = 0; idx < MAX_JOBS; idx++){
+    const job_t & job = jobRunner.jobs[idx];
+    if (job.id == id && (job.state == JOB_QUEUED || job.state == JOB_RUNNING)) active = true;
+  }
+  portEXIT_CRITICAL(&jobRunner.lock);
+  return active;
+}
+
+/*  Checks whether the job has been killed (job functions call this between units of work)
+*
+*   @job - the running job
+*/
+inline bool jobCancelled(const job_t & job){
+  return job.killRequested;
+}
+
+/*  Reports how far along a job is
+*
+*   @job - the running job
+*   @progress - work done so far
+*   @total - total work
+*/
+inline void jobProgress(job_t & job, uint32_t progress, uint32_t total){
+  job.total = total;
+  job.progress = progress;
+}
+
+/*  Waits for exclusive use of the data stream, giving up if the job is killed in the meantime
+*
+*   @job - the running job
+*   @return - true if the data plane is now held (release it with jobReleaseDataPlane)
+*/
+inline bool jobLockDataPlane(const job_t & job){
+  while (!jobCancelled(job)){
+    if (xSemaphoreTake(jobRunner.dataPlane, JOB_LOCK_POLL_MS) == pdTRUE) return true;
+  }
+  return false;
+}
+
+inline void jobReleaseDataPlane(){
+  xSemaphoreGive(jobRunner.dataPlane);
+}
+
+/*  Runs a job from the queue (worker tasks only)
+*
+*   @job - the job
+*/
+inline void jobRun(job_t & job){
+  job.startTime = millis();
+  portENTER_CRITICAL(&jobRunner.lock);
+  bool run = !job.killRequested;
+  if (run) job.state = JOB_RUNNING;
+  portEXIT_CRITICAL(&jobRunner.lock);
+  if (run) job.function(job);
+  job.endTime = millis();
+  portENTER_CRITICAL(&jobRunner.lock);
+  job.state = job.killRequested ? JOB_KILLED : JOB_FINISHED;
+  portEXIT_CRITICAL(&jobRunner.lock);
+  consolePrintf("Job %u (%s) %s after %u ms\n\r", job.id, job.name, (job.state == JOB_KILLED) ? "killed" : "finished", job.endTime - job.startTime);
+}
+
+/*  Prints every job with its state and progress
+*
+*/
+inline void printJobs(){
+  const char * states[] = {"free", "queued", "running", "finished", "killed"};
+  consolePrintf("%-4s %-10s %-9s %9s %10s\n\r", "id", "job", "state", "progress", "time ms");
+  for (int idx = 0; idx < MAX_JOBS; idx++){
+    const job_t & job = jobRunner.jobs[idx];
+    if (job.state == JOB_FREE) continue;
+    uint32_t percent = job.total ? (uint64_t) job.progress * 100 / job.total : 0;
+    uint32_t elapsed = (job.state == JOB_QUEUED) ? 0 : ((job.state == JOB_RUNNING) ? millis() : job.endTime) - job.startTime;
+    consolePrintf("%-4u %-10s %-9s %8u%% %10u\n\r", job.id, job.name, states[job.state], percent, elapsed);
+  }
+}
+
+#endif
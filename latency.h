@@ -0,0 +1,181 @@
+#ifndef LATENCY_H
+#define LATENCY_H
+
+#include <Arduino.h>
+#include <atomic>
+#include "slave_table.h"
+#include "metrics.h"
+#include "console.h"
+
+#define LATENCY_SAMPLE_INTERVAL (50) //one burst in this many carries a latency tag
+#define LATENCY_ARRIVAL_LOG_SIZE (64) //A2DP callbacks remembered while their data waits in the buffer
+#define LATENCY_TAGS (16) //tags in flight at once (tag ids wrap at this)
+
+typedef struct {
+  uint32_t endOffset; //total bytes buffered once this callback's data was added
+  uint32_t time; //micros() when the callback ran
+} latencyArrival_t;
+
+typedef struct {
+  uint32_t arrival; //micros() when the tagged burst's oldest sample arrived over A2DP
+  uint32_t sent; //micros() once the burst was on the data plane (0 while still sending)
+} latencyTag_t;
+
+typedef struct {
+  uint32_t buckets[HISTOGRAM_BUCKETS];
+  uint64_t sum; //microseconds
+  uint32_t max;
+} latencyHistogram_t;
+
+/*  End-to-end latency tracking. The master can't compare its clock with a slave's, so it measures its own part (A2DP arrival
+*   until the tagged burst is on the wire) and the slave reports its part (reception until playout) against the same tag.
+*   Bytes are matched to A2DP arrivals by their running offset in the stream buffer. The arrival log has one consumer (the
+*   packager) but several producers (the A2DP callback and the stream and test jobs), so writers take the lock.
+*/
+typedef struct {
+  latencyArrival_t arrivals[LATENCY_ARRIVAL_LOG_SIZE];
+  std::atomic<uint32_t> arrivalWrite; //producer (A2DP callback)
+  uint32_t arrivalRead; //consumer (packager)
+  std::atomic<uint32_t> produced; //bytes added to the stream buffer
+  uint32_t consumed; //bytes sent or dropped from the front of the stream buffer
+  latencyTag_t tags[LATENCY_TAGS];
+  uint8_t nextTag;
+  uint32_t bursts;
+  latencyHistogram_t slaves[MAX_SLAVES];
+  portMUX_TYPE lock; //arrival log writers, and the histograms (reception task and terminal)
+} latencyTracker_t;
+
+/*  Clears the tracker and sets up its lock. Called once at boot, before the packager runs.
+*
+*   @lt - latency tracker
+*/
+inline void latencyInit(latencyTracker_t & lt){
+  memset(lt.arrivals, 0, sizeof(lt.arrivals));
+  lt.arrivalWrite.store(0, std::memory_order_relaxed);
+  lt.arrivalRead = 0;
+  lt.produced.store(0, std::memory_order_relaxed);
+  lt.consumed = 0;
+  memset(lt.tags, 0, sizeof(lt.tags));
+  lt.nextTag = 0;
+  lt.bursts = 0;
+  memset(lt.slaves, 0, sizeof(lt.slaves));
+  lt.lock = portMUX_INITIALIZER_UNLOCKED;
+}
+
+/*  Clears every slave's latency histogram
+*
+*   @lt - latency tracker
+*/
+inline void latencyResetHistograms(latencyTracker_t & lt){
+  portENTER_CRITICAL(&lt.lock);
+  memset(lt.slaves, 0, sizeof(lt.slaves));
+  portEXIT_CRITICAL(&lt.lock);
+}
+
+/*  Records the arrival of data in the stream buffer (producer side, any task)
+*
+*   @lt - latency tracker
+*   @bytes - number of bytes actually buffered
+*/
+inline void latencyRecordArrival(latencyTracker_t & lt, uint32_t bytes){
+  if (bytes == 0) return;
+  uint32_t now = micros();
+  portENTER_CRITICAL(&lt.lock);
+  uint32_t write = lt.arrivalWrite.load(std::memory_order_relaxed);
+  latencyArrival_t & arrival = lt.arrivals[write % LATENCY_ARRIVAL_LOG_SIZE];
+  arrival.endOffset = lt.produced.fetch_add(bytes, std::memory_order_relaxed) + bytes;
+  arrival.time = now;
+  lt.arrivalWrite.store(write + 1, std::memory_order_release);
+  portEXIT_CRITICAL(&lt.lock);
+}
+
+/*  Accounts for bytes leaving the front of the stream buffer (consumer side)
+*
+*   @lt - latency tracker
+*   @bytes - number of bytes sent or dropped
+*/
+inline void latencyConsume(latencyTracker_t & lt, uint32_t bytes){
+  lt.consumed += bytes;
+}
+
+/*  Lines the consumer back up with the producer after the buffer is flushed
+*
+*   @lt - latency tracker
+*/
+inline void latencyResync(latencyTracker_t & lt){
+  lt.arrivalRead = lt.arrivalWrite.load(std::memory_order_acquire);
+  lt.consumed = lt.produced.load(std::memory_order_relaxed);
+}
+
+/*  Decides whether the next burst gets a latency tag and remembers when its oldest sample arrived
+*
+*   @lt - latency tracker
+*   @return - tag id, or -1 if the burst isn't sampled
+*/
+inline int latencyTagBurst(latencyTracker_t & lt){
+  if (++lt.bursts % LATENCY_SAMPLE_INTERVAL != 0) return -1;
+
+  uint32_t write = lt.arrivalWrite.load(std::memory_order_acquire);
+  if (write - lt.arrivalRead > LATENCY_ARRIVAL_LOG_SIZE) lt.arrivalRead = write - LATENCY_ARRIVAL_LOG_SIZE; //fell behind, oldest entries were overwritten
+  while (lt.arrivalRead != write && (int32_t) (lt.arrivals[lt.arrivalRead % LATENCY_ARRIVAL_LOG_SIZE].endOffset - lt.consumed) <= 0) lt.arrivalRead++;
+  if (lt.arrivalRead == write) return -1; //front of the buffer didn't come from a recorded arrival
+
+  int tag = lt.nextTag;
+  lt.nextTag = (lt.nextTag + 1) % LATENCY_TAGS;
+  lt.tags[tag].arrival = lt.arrivals[lt.arrivalRead % LATENCY_ARRIVAL_LOG_SIZE].time;
+  lt.tags[tag].sent = 0;
+  return tag;
+}
+
+/*  Marks a tagged burst as sent
+*
+*   @lt - latency tracker
+*   @tag - tag id from latencyTagBurst
+*/
+inline void latencyTagSent(latencyTracker_t & lt, int tag){
+  if (tag >= 0) lt.tags[tag].sent = micros();
+}
+
+/*  Combines a slave's playout report with the master's half of the measurement
+*
+*   @lt - latency tracker
+*   @idx - slave table index of the reporting slave
+*   @tag - tag id echoed by the slave
+*   @slaveDelay - microseconds the slave held the tagged samples before playing them
+*/
+inline void latencyReport(latencyTracker_t & lt, int idx, uint8_t tag, uint32_t slaveDelay){
+  if (idx < 0 || tag >= LATENCY_TAGS || lt.tags[tag].sent == 0) return;
+  uint32_t latency = (lt.tags[tag].sent - lt.tags[tag].arrival) + slaveDelay;
+  latencyHistogram_t & histogram = lt.slaves[idx];
+  portENTER_CRITICAL(&lt.lock);
+  histogram.buckets[(latency == 0) ? 0 : 32 - __builtin_clz(latency)]++;
+  histogram.sum += latency;
+  if (latency > histogram.max) histogram.max = latency;
+  portEXIT_CRITICAL(&lt.lock);
+}
+
+/*  Prints each slave's latency distribution, either readable or as CSV (address,count,mean_us,p50_us,p99_us,max_us)
+*
+*   @lt - latency tracker
+*   @table - slave table
+*   @csv - true for CSV output
+*/
+inline void printLatency(latencyTracker_t & lt, const slaveTable_t & table, bool csv){
+  latencyHistogram_t histogram;
+  if (csv) consolePrint("address,count,mean_us,p50_us,p99_us,max_us\n\r");
+  for (int idx = 0; idx < slaveEntries(table); idx++){
+    if (!slavePresent(table, idx)) continue;
+    portENTER_CRITICAL(&lt.lock);
+    histogram = lt.slaves[idx];
+    portEXIT_CRITICAL(&lt.lock);
+    uint32_t count = 0;
+    for (int bucket = 0; bucket < HISTOGRAM_BUCKETS; bucket++) count += histogram.buckets[bucket];
+    uint32_t mean = count ? histogram.sum / count : 0;
+    uint32_t p50 = histogramPercentile(histogram.buckets, count, 50);
+    uint32_t p99 = histogramPercentile(histogram.buckets, count, 99);
+    if (csv) consolePrintf("%d,%u,%u,%u,%u,%u\n\r", table.slaves[idx].address, count, mean, p50, p99, histogram.max);
+    else consolePrintf("ADDR%d: n=%u mean=%u us p50<=%u us p99<=%u us max=%u us\n\r", table.slaves[idx].address, count, mean, p50, p99, histogram.max);
+  }
+}
+
+#endif
\ No newline at end of file
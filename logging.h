@@ -0,0 +1,144 @@
+#ifndef LOGGING_H
+#define LOGGING_H
+
+#include <Arduino.h>
+#include <atomic>
+#include <esp_timer.h>
+
+//Compile-time log levels. Call sites above LOG_LEVEL compile to nothing.
+#define LOG_LEVEL_NONE (0)
+#define LOG_LEVEL_ERROR (1)
+#define LOG_LEVEL_WARN (2)
+#define LOG_LEVEL_INFO (3)
+#define LOG_LEVEL_DEBUG (4)
+
+#ifndef LOG_LEVEL
+#define LOG_LEVEL LOG_LEVEL_INFO
+#endif
+
+#define LOG_RING_SIZE (64) //records per core (power of 2)
+#define LOG_MAX_ARGS (4)
+
+/*  A log record is the format string's address (which doubles as its id) plus raw 32 bit arguments.
+*   Formatting happens later in logWriterTask, so arguments must be integers, characters or pointers to strings that outlive the record (literals).
+*/
+typedef struct {
+  std::atomic<uint32_t> sequence; //slot ownership (bounded MPMC queue sequence number)
+  uint32_t timeUs; //esp_timer_get_time() when the record was written (the same clock on both cores, unlike CCOUNT)
+  const char * format;
+  uint32_t args[LOG_MAX_ARGS];
+  uint8_t level;
+} logRecord_t;
+
+typedef struct {
+  logRecord_t records[LOG_RING_SIZE];
+  std::atomic<uint32_t> writePos;
+  uint32_t readPos; //only touched by the writer task
+  std::atomic<uint32_t> dropped;
+} logRing_t;
+
+extern logRing_t logRings[portNUM_PROCESSORS];
+extern TaskHandle_t logWriter; //the console writer, notified for every record so it can sleep until there's work (NULL until it starts)
+
+inline uint32_t logArg(int arg) { return arg; }
+inline uint32_t logArg(unsigned int arg) { return arg; }
+inline uint32_t logArg(long arg) { return arg; }
+inline uint32_t logArg(unsigned long arg) { return arg; }
+inline uint32_t logArg(short arg) { return arg; }
+inline uint32_t logArg(unsigned short arg) { return arg; }
+inline uint32_t logArg(signed char arg) { return arg; }
+inline uint32_t logArg(unsigned char arg) { return arg; }
+inline uint32_t logArg(char arg) { return arg; }
+inline uint32_t logArg(bool arg) { return arg; }
+inline uint32_t logArg(const char * arg) { return (uint32_t) (uintptr_t) arg; }
+
+/*  Sets every ring slot up as free. Must run before any task logs.
+*
+*/
+inline void logInit(){
+  for (int core = 0; core < portNUM_PROCESSORS; core++){
+    for (uint32_t i = 0; i < LOG_RING_SIZE; i++) logRings[core].records[i].sequence.store(i, std::memory_order_relaxed);
+    logRings[core].writePos.store(0, std::memory_order_relaxed);
+    logRings[core].readPos = 0;
+    logRings[core].dropped.store(0, std::memory_order_relaxed);
+  }
+}
+
+/*  Writes a record into the current core's ring. Never blocks; if the ring is full the record is counted as dropped.
+*
+*   @level - log level of the record
+*   @format - printf format string (must be a literal)
+*   @args - up to LOG_MAX_ARGS integer or string literal arguments
+*/
+template <typename... Args>
+inline void IRAM_ATTR logWrite(uint8_t level, const char * format, Args... args){
+  static_assert(sizeof...(Args) <= LOG_MAX_ARGS, "Too many log arguments");
+  uint32_t packed[LOG_MAX_ARGS + 1] = {logArg(args)...};
+  logRing_t & ring = logRings[xPortGetCoreID()];
+
+  uint32_t pos = ring.writePos.load(std::memory_order_relaxed);
+  logRecord_t * record;
+  while (1){
+    record = &ring.records[pos & (LOG_RING_SIZE - 1)];
+    int32_t diff = (int32_t) (record->sequence.load(std::memory_order_acquire) - pos);
+    if (diff == 0 && ring.writePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) break; //slot claimed
+    if (diff < 0){ //writer task hasn't caught up
+      ring.dropped.fetch_add(1, std::memory_order_relaxed);
+      return;
+    }
+    if (diff > 0) pos = ring.writePos.load(std::memory_order_relaxed); //another task on this core claimed it first
+  }
+
+  record->timeUs = (uint32_t) esp_timer_get_time();
+  record->format = format;
+  record->level = level;
+  memcpy(record->args, packed, sizeof(record->args));
+  record->sequence.store(pos + 1, std::memory_order_release); //publish
+  if (logWriter == NULL) return;
+  if (xPortInIsrContext()) vTaskNotifyGiveFromISR(logWriter, NULL);
+  else xTaskNotifyGive(logWriter);
+}
+
+/*  Takes the oldest record out of a ring (writer task only)
+*
+*   @ring - the ring being read
+*   @out - copy of the record
+*   @return - true if a record was available
+*/
+inline bool logRead(logRing_t & ring, logRecord_t & out){
+  logRecord_t & record = ring.records[ring.readPos & (LOG_RING_SIZE - 1)];
+  if (record.sequence.load(std::memory_order_acquire) != ring.readPos + 1) return false;
+  out.timeUs = record.timeUs;
+  out.format = record.format;
+  out.level = record.level;
+  memcpy(out.args, record.args, sizeof(out.args));
+  record.sequence.store(ring.readPos + LOG_RING_SIZE, std::memory_order_release); //hand the slot back to writers
+  ring.readPos++;
+  return true;
+}
+
+#if LOG_LEVEL >= LOG_LEVEL_ERROR
+#define LOG_ERROR(...) logWrite(LOG_LEVEL_ERROR, __VA_ARGS__)
+#else
+#define LOG_ERROR(...) do {} while (0)
+#endif
+
+#if LOG_LEVEL >= LOG_LEVEL_WARN
+#define LOG_WARN(...) logWrite(LOG_LEVEL_WARN, __VA_ARGS__)
+#else
+#define LOG_WARN(...) do {} while (0)
+#endif
+
+#if LOG_LEVEL >= LOG_LEVEL_INFO
+#define LOG_INFO(...) logWrite(LOG_LEVEL_INFO, __VA_ARGS__)
+#else
+#define LOG_INFO(...) do {} while (0)
+#endif
+
+#if LOG_LEVEL >= LOG_LEVEL_DEBUG
+#define LOG_DEBUG(...) logWrite(LOG_LEVEL_DEBUG, __VA_ARGS__)
+#else
+#define LOG_DEBUG(...) do {} while (0)
+#endif
+
+#endif
\ No newline at end of file
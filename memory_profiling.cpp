@@ -0,0 +1,62 @@
+#include <Arduino.h>
+#include <new>
+#include "memory_profiling.h"
+
+//Global new/delete replacements so every C++ allocation (deque blocks, BLE objects, strings) is attributed to a subsystem.
+//They live in their own translation unit so there's exactly one definition however many files include the header.
+//Allocations made with malloc directly (e.g. inside the BT controller) only show up in the heap totals.
+//Inside a USE_BLOCK_POOL scope, requests are served from the pool first and never reach the heap or the profile.
+
+extern const int memoryHooksStaticAllocation = STATIC_ALLOCATION;
+
+/*  Allocates from the block pool in scope, or from the heap with an allocationHeader_t in front of the block
+*
+*   @size - bytes requested
+*   @return - the block, or NULL if the heap is exhausted
+*/
+static void * profiledAllocate(size_t size){
+  void * block = blockPoolAllocate(size);
+  if (block != NULL) return block;
+  heapCheckAllocation(size);
+  allocationHeader_t * header = (allocationHeader_t *) malloc(sizeof(allocationHeader_t) + size);
+  if (header == NULL) return NULL;
+  memoryRecordAllocation(header, size);
+  return header + 1;
+}
+
+void * operator new(size_t size){
+  void * ptr = profiledAllocate(size);
+  if (ptr == NULL) abort();
+  return ptr;
+}
+
+void * operator new[](size_t size){
+  return operator new(size);
+}
+
+void * operator new(size_t size, const std::nothrow_t &) noexcept {
+  return profiledAllocate(size);
+}
+
+void * operator new[](size_t size, const std::nothrow_t & tag) noexcept {
+  return operator new(size, tag);
+}
+
+void operator delete(void * ptr) noexcept {
+  if (ptr == NULL || blockPoolFree(stagingPool, ptr)) return;
+  allocationHeader_t * header = (allocationHeader_t *) ptr - 1;
+  memoryRecordFree(header);
+  free(header);
+}
+
+void operator delete[](void * ptr) noexcept {
+  operator delete(ptr);
+}
+
+void operator delete(void * ptr, size_t size) noexcept {
+  operator delete(ptr);
+}
+
+void operator delete[](void * ptr, size_t size) noexcept {
+  operator delete(ptr);
+}
@@ -0,0 +1,236 @@
+#ifndef MEMORY_PROFILING_H
+#define MEMORY_PROFILING_H
+
+#include <Arduino.h>
+#include <atomic>
+#include <esp_heap_caps.h>
+#include "static_allocation.h"
+#include "console.h"
+
+#define MAX_PROFILED_TASKS (MAX_STATIC_TASKS + 4) //every task createTask() can make, plus the A2DP callback's task and headroom
+
+typedef enum {
+  SUBSYSTEM_OTHER, //setup(), BT stack tasks and anything not registered
+  SUBSYSTEM_A2DP, //A2DP data callback
+  SUBSYSTEM_STREAM, //data stream packager
+  SUBSYSTEM_CONTROL_PLANE, //packet reception and ring token watchdog
+  SUBSYSTEM_TERMINAL,
+  SUBSYSTEM_CONSOLE, //console writer (also formats log records)
+  SUBSYSTEM_JOBS, //background terminal jobs
+  NUM_SUBSYSTEMS
+} subsystem_t;
+
+const char * const subsystemNames[NUM_SUBSYSTEMS] = {"other", "a2dp", "stream", "control plane", "terminal", "console", "jobs"};
+
+typedef struct {
+  std::atomic<uint32_t> allocations;
+  std::atomic<uint32_t> frees;
+  std::atomic<int32_t> liveBytes;
+  std::atomic<int32_t> peakLiveBytes;
+} subsystemAllocations_t;
+
+/*  Put in front of every block operator new hands out, so a free is charged to the subsystem that made the allocation
+*   rather than the one releasing it. 8 bytes, so the block after it keeps malloc's alignment.
+*/
+typedef struct {
+  uint32_t size; //bytes requested
+  uint8_t subsystem;
+  uint8_t reserved[3];
+} allocationHeader_t;
+
+static_assert(sizeof(allocationHeader_t) == 8, "allocationHeader_t must keep blocks 8 byte aligned");
+
+/*  Allocation counts attributed to subsystems (by the task doing the allocating) plus a resettable minimum free heap,
+*   so a single streaming session can be measured in isolation.
+*/
+typedef struct {
+  TaskHandle_t tasks[MAX_PROFILED_TASKS];
+  subsystem_t taskSubsystems[MAX_PROFILED_TASKS];
+  std::atomic<uint32_t> numTasks;
+  subsystemAllocations_t subsystems[NUM_SUBSYSTEMS];
+  std::atomic<uint32_t> sessionMinFree; //lowest internal free heap sampled since the last reset (see memorySampleFreeHeap)
+} memoryProfile_t;
+
+extern memoryProfile_t memoryProfile;
+extern const int memoryHooksStaticAllocation; //STATIC_ALLOCATION as memory_profiling.cpp (and so operator new) was built with
+
+/*  Attributes a task's allocations to a subsystem
+*
+*   @task - task handle
+*   @subsystem - subsystem the task belongs to
+*/
+inline void memoryRegisterTask(TaskHandle_t task, subsystem_t subsystem){
+  static portMUX_TYPE registerLock = portMUX_INITIALIZER_UNLOCKED; //boot registers tasks from both cores at once
+  if (task == NULL) return;
+  portENTER_CRITICAL(&registerLock);
+  uint32_t idx = memoryProfile.numTasks.load(std::memory_order_relaxed);
+  bool registered = (idx < MAX_PROFILED_TASKS);
+  if (registered){
+    memoryProfile.tasks[idx] = task;
+    memoryProfile.taskSubsystems[idx] = subsystem;
+    memoryProfile.numTasks.store(idx + 1, std::memory_order_release);
+  }
+  portEXIT_CRITICAL(&registerLock);
+  //straight to the UART: the task's allocations would go to "other" and skip the static build's heap check, so this must be seen
+  if (!registered) ets_printf("MAX_PROFILED_TASKS reached, task %s not profiled as %s\n", pcTaskGetName(task), subsystemNames[subsystem]);
+}
+
+/*  Gets the subsystem the calling task belongs to
+*
+*/
+inline subsystem_t memoryCurrentSubsystem(){
+  TaskHandle_t task = xTaskGetCurrentTaskHandle();
+  uint32_t numTasks = memoryProfile.numTasks.load(std::memory_order_acquire);
+  for (uint32_t idx = 0; idx < numTasks; idx++){
+    if (memoryProfile.tasks[idx] == task) return memoryProfile.taskSubsystems[idx];
+  }
+  return SUBSYSTEM_OTHER;
+}
+
+/*  Records an allocation against the calling task's subsystem and stamps the block's header with it
+*
+*   @header - header in front of the new block
+*   @size - bytes requested
+*/
+inline void memoryRecordAllocation(allocationHeader_t * header, size_t size){
+  subsystem_t subsystem = memoryCurrentSubsystem();
+  header->size = size;
+  header->subsystem = subsystem;
+  subsystemAllocations_t & counts = memoryProfile.subsystems[subsystem];
+  int32_t live = counts.liveBytes.fetch_add(size, std::memory_order_relaxed) + size;
+  counts.allocations.fetch_add(1, std::memory_order_relaxed);
+  if (live > counts.peakLiveBytes.load(std::memory_order_relaxed)) counts.peakLiveBytes.store(live, std::memory_order_relaxed);
+}
+
+/*  Records a free against the subsystem that made the allocation, whichever task frees it
+*
+*   @header - header in front of the block being freed
+*/
+inline void memoryRecordFree(const allocationHeader_t * header){
+  subsystemAllocations_t & counts = memoryProfile.subsystems[header->subsystem];
+  counts.liveBytes.fetch_sub(header->size, std::memory_order_relaxed);
+  counts.frees.fetch_add(1, std::memory_order_relaxed);
+}
+
+/*  Folds the current internal free heap into the session minimum. Called periodically rather than on every allocation,
+*   which keeps the heap walk off the allocation path (a dip shorter than the period can be missed).
+*
+*/
+inline void memorySampleFreeHeap(){
+  uint32_t freeHeap = heap_caps_get_free_size(MALLOC_CAP_INTERNAL);
+  if (freeHeap < memoryProfile.sessionMinFree.load(std::memory_order_relaxed)) memoryProfile.sessionMinFree.store(freeHeap, std::memory_order_relaxed);
+}
+
+/*  In static allocation builds, stops the system if one of the sketch's own tasks allocates after setup() outside a HEAP_EXEMPT scope.
+*   Tasks belonging to the BT stack (SUBSYSTEM_OTHER) aren't checked since their allocations aren't under the sketch's control.
+*
+*   @size - number of bytes requested
+*/
+inline void heapCheckAllocation(size_t size){
+#if STATIC_ALLOCATION
+  if (heapLocked && heapExemptDepth == 0 && memoryCurrentSubsystem() != SUBSYSTEM_OTHER){
+    ets_printf("Heap allocation of %u bytes after boot in task %s\n", size, pcTaskGetName(NULL));
+    abort();
+  }
+#endif
+}
+
+/*  Stops boot if the sketch and memory_profiling.cpp were built with different STATIC_ALLOCATION settings, which happens when
+*   the flag is defined in the sketch instead of the build flags (operator new would then never check, or check a pool that isn't there)
+*
+*/
+inline void memoryCheckBuildFlags(){
+  if (memoryHooksStaticAllocation == STATIC_ALLOCATION) return;
+  ets_printf("STATIC_ALLOCATION is %d in the sketch but %d in memory_profiling.cpp, set it in the build flags\n", STATIC_ALLOCATION, memoryHooksStaticAllocation);
+  abort();
+}
+
+/*  Starts a new measurement window: zeroes allocation counts, and sets peaks and the session minimum to current values
+*
+*/
+inline void memoryResetPeaks(){
+  for (int subsystem = 0; subsystem < NUM_SUBSYSTEMS; subsystem++){
+    subsystemAllocations_t & counts = memoryProfile.subsystems[subsystem];
+    counts.allocations.store(0, std::memory_order_relaxed);
+    counts.frees.store(0, std::memory_order_relaxed);
+    counts.peakLiveBytes.store(counts.liveBytes.load(std::memory_order_relaxed), std::memory_order_relaxed);
+  }
+  memoryProfile.sessionMinFree.store(heap_caps_get_free_size(MALLOC_CAP_INTERNAL), std::memory_order_relaxed);
+}
+
+/*  Prints heap usage for each memory capability, stack high-water marks for the profiled tasks and allocations by subsystem
+*
+*/
+inline void printMemoryProfile(){
+  const uint32_t caps[] = {MALLOC_CAP_INTERNAL, MALLOC_CAP_DMA, MALLOC_CAP_SPIRAM};
+  const char * capNames[] = {"internal", "dma", "psram"};
+
+  consolePrintf("%-10s %10s %10s %10s\n\r", "heap", "free", "min free", "largest");
+  for (int cap = 0; cap < 3; cap++){
+    consolePrintf("%-10s %10u %10u %10u\n\r", capNames[cap], heap_caps_get_free_size(caps[cap]), heap_caps_get_minimum_free_size(caps[cap]), heap_caps_get_largest_free_block(caps[cap]));
+  }
+  consolePrintf("Internal min free since reset: %u\n\r", memoryProfile.sessionMinFree.load(std::memory_order_relaxed));
+  consolePrintf("Staging pool: %d/%d blocks in use, %u sent to the heap\n\r", blockPoolInUse(stagingPool), BLOCK_POOL_BLOCKS, stagingPool.fallbacks);
+
+  consolePrint("Stack high-water marks (bytes never used):\n\r");
+  uint32_t numTasks = memoryProfile.numTasks.load(std::memory_order_acquire);
+  for (uint32_t idx = 0; idx < numTasks; idx++){
+    consolePrintf("  %-26s %u\n\r", pcTaskGetName(memoryProfile.tasks[idx]), uxTaskGetStackHighWaterMark(memoryProfile.tasks[idx]));
+  }
+
+  consolePrintf("%-14s %10s %10s %10s %10s\n\r", "subsystem", "allocs", "frees", "live", "peak");
+  for (int subsystem = 0; subsystem < NUM_SUBSYSTEMS; subsystem++){
+    const subsystemAllocations_t & counts = memoryProfile.subsystems[subsystem];
+    consolePrintf("%-14s %10u %10u %10d %10d\n\r", subsystemNames[subsystem], counts.allocations.load(std::memory_order_relaxed), counts.frees.load(std::memory_order_relaxed),
+      counts.liveBytes.load(std::memory_order_relaxed), counts.peakLiveBytes.load(std::memory_order_relaxed));
+  }
+}
+
+/*  Checks the allocation hooks from the calling task: blocks are stamped with its subsystem, counts and live bytes balance
+*   once they're freed, and allocations inside a USE_BLOCK_POOL scope come from the pool without touching the profile.
+*
+*   @return - number of failed checks
+*/
+inline int memorySelfTest(){
+  const size_t sizes[] = {1, 24, 100, 512, 2000};
+  const int numBlocks = sizeof(sizes) / sizeof(sizes[0]);
+  uint8_t * blocks[numBlocks];
+  bool stamped = true;
+  subsystem_t subsystem = memoryCurrentSubsystem();
+  subsystemAllocations_t & counts = memoryProfile.subsystems[subsystem];
+  HEAP_EXEMPT(); //the test has to allocate
+
+  uint32_t allocations = counts.allocations.load(std::memory_order_relaxed);
+  uint32_t frees = counts.frees.load(std::memory_order_relaxed);
+  int32_t live = counts.liveBytes.load(std::memory_order_relaxed);
+  size_t total = 0;
+  for (int idx = 0; idx < numBlocks; idx++){
+    blocks[idx] = new uint8_t[sizes[idx]];
+    const allocationHeader_t * header = (const allocationHeader_t *) blocks[idx] - 1;
+    stamped &= (header->size == sizes[idx] && header->subsystem == subsystem);
+    total += sizes[idx];
+  }
+  bool counted = (counts.allocations.load(std::memory_order_relaxed) - allocations == numBlocks) && (counts.liveBytes.load(std::memory_order_relaxed) - live == (int32_t) total)
+    && (counts.peakLiveBytes.load(std::memory_order_relaxed) >= live + (int32_t) total);
+  for (int idx = 0; idx < numBlocks; idx++) delete[] blocks[idx];
+  bool balanced = (counts.frees.load(std::memory_order_relaxed) - frees == numBlocks) && (counts.liveBytes.load(std::memory_order_relaxed) == live);
+
+  int inUse = blockPoolInUse(stagingPool);
+  uint8_t * pooled;
+  {
+    USE_BLOCK_POOL(stagingPool);
+    pooled = new uint8_t[BLOCK_POOL_BLOCK_SIZE];
+  }
+  bool fromPool = (pooled >= &stagingPool.blocks[0][0] && pooled < &stagingPool.blocks[0][0] + sizeof(stagingPool.blocks)) && (blockPoolInUse(stagingPool) == inUse + 1);
+  delete[] pooled;
+  fromPool &= (blockPoolInUse(stagingPool) == inUse) && (counts.allocations.load(std::memory_order_relaxed) - allocations == numBlocks);
+
+  const char * results[] = {"FAILED", "ok"};
+  consolePrintf("Blocks stamped with the %s subsystem: %s\n\r", subsystemNames[subsystem], results[stamped]);
+  consolePrintf("Allocations and live bytes counted: %s\n\r", results[counted]);
+  consolePrintf("Frees balance the allocations: %s\n\r", results[balanced]);
+  consolePrintf("Block pool serves its scope without the heap: %s\n\r", results[fromPool]);
+  return !stamped + !counted + !balanced + !fromPool;
+}
+
+#endif
\ No newline at end of file
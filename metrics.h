@@ -0,0 +1,209 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <Arduino.h>
+#include <atomic>
+#include "console.h"
+
+#define HISTOGRAM_BUCKETS (33) //bucket n holds values in [2^(n-1), 2^n), bucket 0 holds zero
+#define NUM_PACKET_TYPE_COUNTERS (256)
+
+typedef enum {
+  COUNTER_A2DP_CALLBACKS,
+  COUNTER_A2DP_BYTES,
+  COUNTER_BURSTS_SENT,
+  COUNTER_BYTES_STREAMED,
+  COUNTER_BROADCAST_FRAMES,
+  COUNTER_UNICAST_FRAMES,
+  COUNTER_TOKEN_PERIODS, //watchdog periods in which the token came around
+  COUNTER_TOKENS_GENERATED,
+  COUNTER_PACKETS_RECEIVED,
+  COUNTER_PACKETS_UNKNOWN,
+  COUNTER_PACKET_POOL_EXHAUSTED,
+  NUM_COUNTERS
+} counterId_t;
+
+typedef enum {
+  GAUGE_BUFFER_DEPTH,
+  GAUGE_DROPPED_BYTES,
+  GAUGE_OVERFLOW_EVENTS,
+  GAUGE_CREDIT_STARVATION,
+  GAUGE_STREAM_STATE,
+  GAUGE_PACKET_POOL_IN_USE,
+  GAUGE_PACKET_QUEUE_DEPTH,
+  NUM_GAUGES
+} gaugeId_t;
+
+typedef enum {
+  HISTOGRAM_A2DP_CALLBACK_BYTES,
+  HISTOGRAM_BURST_BYTES,
+  HISTOGRAM_BURST_TIME_US,
+  HISTOGRAM_PACKET_HANDLING_US,
+  HISTOGRAM_PACKET_BATCH_SIZE,
+  NUM_HISTOGRAMS
+} histogramId_t;
+
+const char * const counterNames[NUM_COUNTERS] = {"a2dp_callbacks", "a2dp_bytes", "bursts_sent", "bytes_streamed", "broadcast_frames", "unicast_frames", "token_periods", "tokens_generated", "packets_received", "packets_unknown", "packet_pool_exhausted"};
+const char * const gaugeNames[NUM_GAUGES] = {"buffer_depth", "dropped_bytes", "overflow_events", "credit_starvation", "stream_state", "packet_pool_in_use", "packet_queue_depth"};
+const char * const histogramNames[NUM_HISTOGRAMS] = {"a2dp_callback_bytes", "burst_bytes", "burst_time_us", "packet_handling_us", "packet_batch_size"};
+
+typedef struct {
+  std::atomic<uint32_t> buckets[HISTOGRAM_BUCKETS];
+  std::atomic<uint32_t> sum;
+} histogram_t;
+
+/*  Every task increments the copy for the core it's running on, so the two cores never fight over a cache line or retry an atomic.
+*   Readers add the copies together.
+*/
+typedef struct {
+  std::atomic<uint32_t> counters[portNUM_PROCESSORS][NUM_COUNTERS];
+  histogram_t histograms[portNUM_PROCESSORS][NUM_HISTOGRAMS];
+  std::atomic<uint32_t> packetTypes[NUM_PACKET_TYPE_COUNTERS];
+  std::atomic<int32_t> gauges[NUM_GAUGES];
+  std::atomic<int32_t> gaugePeaks[NUM_GAUGES];
+} metrics_t;
+
+extern metrics_t metrics;
+
+/*  Adds to a counter
+*
+*   @id - the counter
+*   @amount - how much to add
+*/
+inline void IRAM_ATTR metricsCount(counterId_t id, uint32_t amount = 1){
+  metrics.counters[xPortGetCoreID()][id].fetch_add(amount, std::memory_order_relaxed);
+}
+
+/*  Sets a gauge and tracks its peak
+*
+*   @id - the gauge
+*   @value - current value
+*/
+inline void IRAM_ATTR metricsGauge(gaugeId_t id, int32_t value){
+  metrics.gauges[id].store(value, std::memory_order_relaxed);
+  if (value > metrics.gaugePeaks[id].load(std::memory_order_relaxed)) metrics.gaugePeaks[id].store(value, std::memory_order_relaxed);
+}
+
+/*  Adds a sample to a log2 bucketed histogram
+*
+*   @id - the histogram
+*   @value - the sample
+*/
+inline void IRAM_ATTR metricsRecord(histogramId_t id, uint32_t value){
+  histogram_t & histogram = metrics.histograms[xPortGetCoreID()][id];
+  int bucket = (value == 0) ? 0 : 32 - __builtin_clz(value);
+  histogram.buckets[bucket].fetch_add(1, std::memory_order_relaxed);
+  histogram.sum.fetch_add(value, std::memory_order_relaxed);
+}
+
+/*  Counts a received packet by type
+*
+*   @type - the packet type
+*/
+inline void IRAM_ATTR metricsCountPacket(uint8_t type){
+  metrics.packetTypes[type].fetch_add(1, std::memory_order_relaxed);
+}
+
+/*  Gets a counter summed across cores
+*
+*   @id - the counter
+*/
+inline uint32_t metricsCounterTotal(counterId_t id){
+  uint32_t total = 0;
+  for (int core = 0; core < portNUM_PROCESSORS; core++) total += metrics.counters[core][id].load(std::memory_order_relaxed);
+  return total;
+}
+
+/*  Merges a histogram across cores
+*
+*   @id - the histogram
+*   @buckets - output bucket counts (HISTOGRAM_BUCKETS entries)
+*   @count - output total number of samples
+*   @sum - output sum of all samples
+*/
+inline void metricsHistogramTotal(histogramId_t id, uint32_t * buckets, uint32_t & count, uint32_t & sum){
+  count = 0;
+  sum = 0;
+  for (int bucket = 0; bucket < HISTOGRAM_BUCKETS; bucket++){
+    buckets[bucket] = 0;
+    for (int core = 0; core < portNUM_PROCESSORS; core++) buckets[bucket] += metrics.histograms[core][id].buckets[bucket].load(std::memory_order_relaxed);
+    count += buckets[bucket];
+  }
+  for (int core = 0; core < portNUM_PROCESSORS; core++) sum += metrics.histograms[core][id].sum.load(std::memory_order_relaxed);
+}
+
+/*  Gets the upper bound of the bucket a percentile falls in
+*
+*   @buckets - merged bucket counts
+*   @count - total number of samples
+*   @percentile - 0 to 100
+*/
+inline uint32_t histogramPercentile(const uint32_t * buckets, uint32_t count, uint32_t percentile){
+  uint64_t target = ((uint64_t) count * percentile + 99) / 100;
+  uint64_t seen = 0;
+  for (int bucket = 0; bucket < HISTOGRAM_BUCKETS; bucket++){
+    seen += buckets[bucket];
+    if (seen >= target && seen > 0) return (bucket == 0) ? 0 : (uint32_t) ((1ULL << bucket) - 1);
+  }
+  return 0;
+}
+
+/*  Zeroes every counter, gauge peak and histogram
+*
+*/
+inline void metricsReset(){
+  for (int core = 0; core < portNUM_PROCESSORS; core++){
+    for (int id = 0; id < NUM_COUNTERS; id++) metrics.counters[core][id].store(0, std::memory_order_relaxed);
+    for (int id = 0; id < NUM_HISTOGRAMS; id++){
+      for (int bucket = 0; bucket < HISTOGRAM_BUCKETS; bucket++) metrics.histograms[core][id].buckets[bucket].store(0, std::memory_order_relaxed);
+      metrics.histograms[core][id].sum.store(0, std::memory_order_relaxed);
+    }
+  }
+  for (int type = 0; type < NUM_PACKET_TYPE_COUNTERS; type++) metrics.packetTypes[type].store(0, std::memory_order_relaxed);
+  for (int id = 0; id < NUM_GAUGES; id++) metrics.gaugePeaks[id].store(metrics.gauges[id].load(std::memory_order_relaxed), std::memory_order_relaxed);
+}
+
+/*  Prints every metric, either as a readable report or as CSV (kind,name,value,extra)
+*
+*   @csv - true for CSV output
+*/
+inline void printMetrics(bool csv){
+  uint32_t buckets[HISTOGRAM_BUCKETS];
+  uint32_t count, sum;
+
+  if (csv) consolePrint("kind,name,value,extra\n\r");
+
+  for (int id = 0; id < NUM_COUNTERS; id++){
+    if (csv) consolePrintf("counter,%s,%u,\n\r", counterNames[id], metricsCounterTotal((counterId_t) id));
+    else consolePrintf("%-20s %u\n\r", counterNames[id], metricsCounterTotal((counterId_t) id));
+  }
+
+  for (int id = 0; id < NUM_GAUGES; id++){
+    int32_t value = metrics.gauges[id].load(std::memory_order_relaxed);
+    int32_t peak = metrics.gaugePeaks[id].load(std::memory_order_relaxed);
+    if (csv) consolePrintf("gauge,%s,%d,%d\n\r", gaugeNames[id], value, peak);
+    else consolePrintf("%-20s %d (peak %d)\n\r", gaugeNames[id], value, peak);
+  }
+
+  for (int type = 0; type < NUM_PACKET_TYPE_COUNTERS; type++){
+    uint32_t received = metrics.packetTypes[type].load(std::memory_order_relaxed);
+    if (received == 0) continue;
+    if (csv) consolePrintf("packet_type,%d,%u,\n\r", type, received);
+    else consolePrintf("packet type %-8d %u\n\r", type, received);
+  }
+
+  for (int id = 0; id < NUM_HISTOGRAMS; id++){
+    metricsHistogramTotal((histogramId_t) id, buckets, count, sum);
+    if (csv){
+      for (int bucket = 0; bucket < HISTOGRAM_BUCKETS; bucket++){
+        if (buckets[bucket]) consolePrintf("histogram,%s,%u,%u\n\r", histogramNames[id], buckets[bucket], (bucket == 0) ? 0 : (uint32_t) ((1ULL << bucket) - 1));
+      }
+    }
+    else {
+      consolePrintf("%-20s n=%u mean=%u p50<=%u p99<=%u max<=%u\n\r", histogramNames[id], count, count ? sum / count : 0,
+        histogramPercentile(buckets, count, 50), histogramPercentile(buckets, count, 99), histogramPercentile(buckets, count, 100));
+    }
+  }
+}
+
+#endif
\ No newline at end of file
@@ -0,0 +1,136 @@
+#ifndef PACKET_DISPATCH_H
+#define PACKET_DISPATCH_H
+
+#include <BlueteethInternalNetworkStack.h>
+#include <esp_timer.h>
+#include "metrics.h"
+#include "tracing.h"
+#include "logging.h"
+#include "console.h"
+
+#define NUM_PACKET_TYPES (256) //a packet's type is a single byte on the wire
+
+typedef void (*packetHandler_t)(BlueteethPacket & packet);
+
+typedef struct {
+  PacketType type;
+  packetHandler_t handler;
+  const char * name;
+} packetHandlerEntry_t;
+
+typedef struct {
+  uint32_t handled;
+  uint32_t totalUs;
+  uint32_t maxUs;
+} packetHandlerStats_t;
+
+/*  Handlers indexed directly by packet type, so dispatch is one array lookup and an indirect call no matter how many
+*   types have handlers. Built by the compiler from the sketch's packetHandlers[] list (see makePacketDispatch), so it
+*   lives in flash and there's nothing to set up at boot.
+*/
+typedef struct {
+  packetHandler_t handlers[NUM_PACKET_TYPES];
+  const char * names[NUM_PACKET_TYPES];
+} packetDispatchTable_t;
+
+/*  Handling stats per packet type. Only the reception task dispatches, so they need no locking.
+*
+*/
+typedef struct {
+  packetHandlerStats_t stats[NUM_PACKET_TYPES];
+} packetDispatch_t;
+
+extern const packetDispatchTable_t packetDispatchTable;
+extern packetDispatch_t packetDispatch;
+
+//Compile-time list of the integers 0..N-1 (std::index_sequence is C++14, the Arduino core builds as C++11)
+template <size_t... Indexes> struct packetIndexSequence {};
+template <size_t N, size_t... Indexes> struct makePacketIndexSequence : makePacketIndexSequence<N - 1, N - 1, Indexes...> {};
+template <size_t... Indexes> struct makePacketIndexSequence<0, Indexes...> { typedef packetIndexSequence<Indexes...> type; };
+
+//Name: packetHandlerFor
+//Purpose: find the handler listed for a packet type (C++11 constexpr, so a single recursive expression)
+//Inputs: entries (the handler list), numEntries, type
+//Outputs: the handler, or NULL if none is listed
+constexpr packetHandler_t packetHandlerFor(const packetHandlerEntry_t * entries, size_t numEntries, size_t type){
+  return (numEntries == 0) ? NULL : (((uint8_t) entries[0].type == type) ? entries[0].handler : packetHandlerFor(entries + 1, numEntries - 1, type));
+}
+
+//Name: packetHandlerNameFor
+//Purpose: find the name listed for a packet type
+//Inputs: entries (the handler list), numEntries, type
+//Outputs: the name, or NULL if none is listed
+constexpr const char * packetHandlerNameFor(const packetHandlerEntry_t * entries, size_t numEntries, size_t type){
+  return (numEntries == 0) ? NULL : (((uint8_t) entries[0].type == type) ? entries[0].name : packetHandlerNameFor(entries + 1, numEntries - 1, type));
+}
+
+//Name: packetHandlersUnique
+//Purpose: check no packet type is listed twice (for a static_assert next to the list)
+//Inputs: entries (the handler list), numEntries
+//Outputs: true if every type is listed at most once
+constexpr bool packetHandlersUnique(const packetHandlerEntry_t * entries, size_t numEntries){
+  return (numEntries <= 1) || (packetHandlerFor(entries + 1, numEntries - 1, (uint8_t) entries[0].type) == NULL && packetHandlersUnique(entries + 1, numEntries - 1));
+}
+
+template <size_t NumEntries, size_t... Types>
+constexpr packetDispatchTable_t makePacketDispatch(const packetHandlerEntry_t (&entries)[NumEntries], packetIndexSequence<Types...>){
+  return {{packetHandlerFor(entries, NumEntries, Types)...}, {packetHandlerNameFor(entries, NumEntries, Types)...}};
+}
+
+//Name: makePacketDispatch
+//Purpose: build the dispatch table from a handler list at compile time
+//Inputs: entries (a constexpr array of packetHandlerEntry_t)
+//Outputs: the table
+template <size_t NumEntries>
+constexpr packetDispatchTable_t makePacketDispatch(const packetHandlerEntry_t (&entries)[NumEntries]){
+  return makePacketDispatch(entries, typename makePacketIndexSequence<NUM_PACKET_TYPES>::type());
+}
+
+/*  Calls the handler registered for a packet's type and times it. Packets without a handler are counted as unknown
+*   (usually read noise on the line).
+*
+*   @packet - the received packet
+*/
+inline void dispatchPacket(BlueteethPacket & packet){
+  TRACE_SPAN("packet receive");
+  uint8_t type = (uint8_t) packet.type;
+  packetHandler_t handler = packetDispatchTable.handlers[type];
+  metricsCountPacket(type);
+
+  if (handler == NULL){
+    LOG_DEBUG("Unknown packet type %d received.", type);
+    metricsCount(COUNTER_PACKETS_UNKNOWN);
+    return;
+  }
+
+  int64_t handlingStart = esp_timer_get_time();
+  handler(packet);
+  uint32_t handlingUs = esp_timer_get_time() - handlingStart;
+
+  packetHandlerStats_t & stats = packetDispatch.stats[type];
+  stats.handled++;
+  stats.totalUs += handlingUs;
+  if (handlingUs > stats.maxUs) stats.maxUs = handlingUs;
+  metricsRecord(HISTOGRAM_PACKET_HANDLING_US, handlingUs);
+}
+
+/*  Zeroes the per-type handling stats
+*
+*/
+inline void packetDispatchResetStats(){
+  memset(packetDispatch.stats, 0, sizeof(packetDispatch.stats));
+}
+
+/*  Prints every handler with how often it ran and how long it took
+*
+*/
+inline void printPacketDispatch(){
+  consolePrintf("%-6s %-20s %10s %10s %10s\n\r", "type", "handler", "handled", "mean us", "max us");
+  for (int type = 0; type < NUM_PACKET_TYPES; type++){
+    if (packetDispatchTable.handlers[type] == NULL) continue;
+    const packetHandlerStats_t & stats = packetDispatch.stats[type];
+    consolePrintf("%-6d %-20s %10u %10u %10u\n\r", type, packetDispatchTable.names[type], stats.handled, stats.handled ? stats.totalUs / stats.handled : 0, stats.maxUs);
+  }
+}
+
+#endif
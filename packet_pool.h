@@ -0,0 +1,125 @@
+#ifndef PACKET_POOL_H
+#define PACKET_POOL_H
+
+#include <BlueteethInternalNetworkStack.h>
+#include <atomic>
+#include <new>
+#include "metrics.h"
+
+#define PACKET_POOL_SIZE (16) //at most 32 (free slots are tracked in a 32 bit mask)
+
+/*  Preallocated storage for BlueteethPackets. Slots are claimed and returned with a compare-and-swap on a free mask,
+*   so any task can acquire or release without a lock, and nothing touches the heap.
+*/
+typedef struct {
+  alignas(BlueteethPacket) uint8_t storage[PACKET_POOL_SIZE][sizeof(BlueteethPacket)];
+  std::atomic<uint32_t> freeMask; //bit n set = slot n free
+  std::atomic<uint32_t> inUse;
+} packetPool_t;
+
+extern packetPool_t packetPool;
+
+/*  Marks every slot free. Must run before any packet is acquired.
+*
+*/
+inline void packetPoolInit(){
+  packetPool.freeMask.store((PACKET_POOL_SIZE >= 32) ? 0xFFFFFFFF : ((1UL << PACKET_POOL_SIZE) - 1), std::memory_order_relaxed);
+  packetPool.inUse.store(0, std::memory_order_relaxed);
+}
+
+/*  Owns one packet in the pool. Handles can be moved but not copied, so a packet is passed between functions and tasks
+*   by pointer and goes back to the pool exactly once, when the last owner is done with it.
+*/
+class packetHandle {
+  public:
+    inline packetHandle() : slot(-1) {}
+    inline explicit packetHandle(int slot) : slot(slot) {}
+    inline packetHandle(packetHandle && other) : slot(other.slot) { other.slot = -1; }
+    inline packetHandle & operator=(packetHandle && other){
+      if (this != &other){
+        release();
+        slot = other.slot;
+        other.slot = -1;
+      }
+      return *this;
+    }
+    packetHandle(const packetHandle &) = delete;
+    packetHandle & operator=(const packetHandle &) = delete;
+    inline ~packetHandle() { release(); }
+
+    inline BlueteethPacket * get() const { return (slot < 0) ? NULL : reinterpret_cast<BlueteethPacket *>(packetPool.storage[slot]); }
+    inline BlueteethPacket * operator->() const { return get(); }
+    inline BlueteethPacket & operator*() const { return *get(); }
+    inline explicit operator bool() const { return slot >= 0; }
+
+    /*  Gives up ownership without returning the slot (used when a handle is passed through a FreeRTOS queue as a raw slot number)
+    *
+    *   @return - the slot number
+    */
+    inline int detach(){
+      int detached = slot;
+      slot = -1;
+      return detached;
+    }
+
+    /*  Destroys the packet and returns its slot to the pool
+    *
+    */
+    inline void release(){
+      if (slot < 0) return;
+      get()->~BlueteethPacket();
+      metricsGauge(GAUGE_PACKET_POOL_IN_USE, packetPool.inUse.fetch_sub(1, std::memory_order_relaxed) - 1);
+      packetPool.freeMask.fetch_or(1UL << slot, std::memory_order_release);
+      slot = -1;
+    }
+
+  private:
+    int slot;
+};
+
+/*  Claims a free slot (the caller constructs a packet in it)
+*
+*   @return - the slot, or -1 if the pool is exhausted
+*/
+inline int packetPoolClaim(){
+  uint32_t mask = packetPool.freeMask.load(std::memory_order_relaxed);
+  int slot;
+  do {
+    if (mask == 0){
+      metricsCount(COUNTER_PACKET_POOL_EXHAUSTED);
+      return -1;
+    }
+    slot = __builtin_ctz(mask);
+  } while (!packetPool.freeMask.compare_exchange_weak(mask, mask & ~(1UL << slot), std::memory_order_acquire, std::memory_order_relaxed));
+  metricsGauge(GAUGE_PACKET_POOL_IN_USE, packetPool.inUse.fetch_add(1, std::memory_order_relaxed) + 1);
+  return slot;
+}
+
+/*  Takes a free slot and constructs a packet in it
+*
+*   @args - BlueteethPacket constructor arguments (tokenFlag/src/dst)
+*   @return - handle to the packet, empty if the pool is exhausted
+*/
+template <typename... Args>
+inline packetHandle packetPoolAcquire(Args &&... args){
+  int slot = packetPoolClaim();
+  if (slot < 0) return packetHandle();
+  new (packetPool.storage[slot]) BlueteethPacket(std::forward<Args>(args)...);
+  return packetHandle(slot);
+}
+
+/*  Takes a free slot and builds the packet a function returns straight into it, with no copy in between
+*   (e.g. [] { return stack.getPacket(); }). The function isn't called if the pool is exhausted.
+*
+*   @make - returns a BlueteethPacket by value
+*   @return - handle to the packet, empty if the pool is exhausted
+*/
+template <typename Factory>
+inline packetHandle packetPoolEmplace(Factory make){
+  int slot = packetPoolClaim();
+  if (slot < 0) return packetHandle();
+  new (packetPool.storage[slot]) BlueteethPacket(make()); //the returned temporary is elided into the slot
+  return packetHandle(slot);
+}
+
+#endif
\ No newline at end of file
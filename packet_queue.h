@@ -0,0 +1,89 @@
+#ifndef PACKET_QUEUE_H
+#define PACKET_QUEUE_H
+
+#include <Arduino.h>
+#include "packet_pool.h"
+#include "static_allocation.h"
+#include "metrics.h"
+#include "jobs.h"
+
+#define PACKET_BATCH_SIZE (8) //packets handled per wake-up of the reception task
+#define PACKET_BLAST_DEFAULT_COUNT (100) //pings sent by "blast"
+#define PACKET_BLAST_MAX_COUNT (10000)
+#define PACKET_BLAST_SETTLE_MS (500) //"blast" stops waiting once no response has come in for this long
+
+/*  Received packets waiting to be handled, in arrival order. Items are pool slot numbers, so the queue can never hold more
+*   entries than the pool has slots and a send can't fail for lack of room. The loopback queue stands in for the network
+*   stack's receive buffer during "blast local": the intake task drains it on the same wakeups, so packets go through the
+*   whole receive path.
+*/
+typedef struct {
+  QueueHandle_t queue;
+  uint8_t storage[PACKET_POOL_SIZE * sizeof(int8_t)];
+  StaticQueue_t buffer;
+  QueueHandle_t loopback;
+  uint8_t loopbackStorage[PACKET_POOL_SIZE * sizeof(int8_t)];
+  StaticQueue_t loopbackBuffer;
+} packetQueue_t;
+
+extern packetQueue_t packetQueue;
+
+/*  Creates the queue. Must run before the intake task starts.
+*
+*/
+inline void packetQueueInit(){
+  packetQueue.queue = createQueue(PACKET_POOL_SIZE, sizeof(int8_t), packetQueue.storage, &packetQueue.buffer);
+  packetQueue.loopback = createQueue(PACKET_POOL_SIZE, sizeof(int8_t), packetQueue.loopbackStorage, &packetQueue.loopbackBuffer);
+}
+
+/*  Leaves a packet where the intake task will pick it up as if the network stack had received it. The caller then
+*   resumes the intake task, like the stack does.
+*
+*   @packet - the packet being looped back
+*/
+inline void packetLoopbackSend(packetHandle & packet){
+  int8_t slot = packet.detach();
+  xQueueSend(packetQueue.loopback, &slot, portMAX_DELAY);
+}
+
+/*  Takes the oldest looped back packet (intake task only)
+*
+*   @return - handle to the packet, empty if none is waiting
+*/
+inline packetHandle packetLoopbackReceive(){
+  int8_t slot;
+  if (xQueueReceive(packetQueue.loopback, &slot, 0) != pdTRUE) return packetHandle();
+  return packetHandle(slot);
+}
+
+/*  Hands a packet to the reception task. The handle gives up its slot; the receiver takes ownership.
+*
+*   @packet - the packet being delivered
+*/
+inline void packetQueueSend(packetHandle & packet){
+  int8_t slot = packet.detach();
+  xQueueSend(packetQueue.queue, &slot, portMAX_DELAY);
+  metricsGauge(GAUGE_PACKET_QUEUE_DEPTH, uxQueueMessagesWaiting(packetQueue.queue));
+}
+
+/*  Waits for at least one packet, then takes as many as are waiting, up to @max
+*
+*   @packets - filled with handles to the received packets, oldest first
+*   @max - size of @packets
+*   @return - number of packets taken
+*/
+inline int packetQueueReceiveBatch(packetHandle * packets, int max){
+  int8_t slot;
+  int count = 0;
+  TickType_t wait = portMAX_DELAY;
+  while (count < max && xQueueReceive(packetQueue.queue, &slot, wait) == pdTRUE){
+    packets[count++] = packetHandle(slot);
+    wait = 0; //only block for the first one
+  }
+  return count;
+}
+
+void packetBlastJob(job_t & job); //defined in the sketch, since it sends through the network stack
+void packetLoopbackJob(job_t & job); //defined in the sketch, since it wakes the intake task
+
+#endif
@@ -0,0 +1,131 @@
+#ifndef PACKET_TYPES_H
+#define PACKET_TYPES_H
+
+#include <BlueteethInternalNetworkStack.h>
+#include <esp_timer.h>
+#include "payload_codec.h"
+#include "console.h"
+
+// Packet types used by the master that aren't part of the internal network stack's PacketType enum.
+// Values are kept well clear of the stack's own types, and must match the values used by the slave firmware.
+constexpr PacketType SLAVE_CAPABILITIES = (PacketType) 0x40; //slave -> master: address, channels, codecs and max baud
+constexpr PacketType BUFFER_CREDITS = (PacketType) 0x41; //slave -> master: running total of data plane bytes the slave can accept
+constexpr PacketType LATENCY_REPORT = (PacketType) 0x42; //slave -> master: latency tag and time from reception to playout
+constexpr PacketType LOOPBACK = (PacketType) 0x4F; //master only, never on the wire: "blast local" queues these and counts them through dispatch (no handler)
+
+// Payload layouts. The static_asserts pin the wire format shared with the slave firmware.
+typedef struct {
+  uint8_t address;
+  uint8_t channels;
+  uint8_t codecs; //CODEC_* bitmask
+  le32_t maxBaud;
+} slaveCapabilitiesPayload_t;
+static_assert(sizeof(slaveCapabilitiesPayload_t) == 7, "SLAVE_CAPABILITIES payload layout changed");
+
+typedef struct {
+  le32_t creditLimit; //running total of data plane bytes the slave can accept
+} bufferCreditsPayload_t;
+static_assert(sizeof(bufferCreditsPayload_t) == 4, "BUFFER_CREDITS payload layout changed");
+
+typedef struct {
+  uint8_t tag;
+  le32_t slaveDelay; //micros from reception of the tagged burst to playout
+} latencyReportPayload_t;
+static_assert(sizeof(latencyReportPayload_t) == 5, "LATENCY_REPORT payload layout changed");
+
+typedef struct {
+  le32_t checksum;
+  le32_t time; //milliseconds
+} streamResultsPayload_t;
+static_assert(sizeof(streamResultsPayload_t) == 8, "STREAM_RESULTS payload layout changed");
+
+#define PAYLOAD_BENCH_ROUNDS (10000)
+
+/*  Packs a 32 bit integer into 4 bytes one shift at a time, the way payloads were written before the payload structs
+*
+*   @integer - value to pack
+*   @byteArray - output, 4 bytes
+*/
+inline void payloadIntToBytes(uint32_t integer, uint8_t * byteArray){
+  for (int offset = 0; offset < 32; offset += 8) byteArray[offset / 8] = integer >> offset;
+}
+
+/*  Unpacks 4 little-endian bytes one shift at a time, the way payloads were read before the payload structs
+*
+*   @byteArray - 4 bytes
+*   @return - the integer
+*/
+inline uint32_t payloadBytesToInt(const uint8_t * byteArray){
+  uint32_t integer = 0;
+  for (int offset = 0; offset < 32; offset += 8) integer |= (uint32_t) byteArray[offset / 8] << offset;
+  return integer;
+}
+
+/*  Round trips every payload struct through a packet, checks the wire bytes against the byte-at-a-time helpers,
+*   then times encode + decode of a STREAM_RESULTS payload both ways
+*
+*   @return - number of checks that failed
+*/
+inline int payloadSelfTest(){
+  const uint32_t pattern = 0x89ABCDEF; //top bit set, and every byte different, so truncation, sign extension and byte order all show
+  BlueteethPacket packet(false);
+  memset(packet.payload, 0, PACKET_PAYLOAD_SIZE);
+  const char * results[] = {"FAILED", "ok"};
+
+  slaveCapabilitiesPayload_t capabilities;
+  capabilities.address = 7;
+  capabilities.channels = 2;
+  capabilities.codecs = 0x03;
+  capabilities.maxBaud = pattern;
+  payloadEncode(packet, capabilities);
+  slaveCapabilitiesPayload_t decodedCapabilities = payloadDecode<slaveCapabilitiesPayload_t>(packet);
+  bool capabilitiesOk = decodedCapabilities.address == 7 && decodedCapabilities.channels == 2 && decodedCapabilities.codecs == 0x03
+    && (uint32_t) decodedCapabilities.maxBaud == pattern && packet.payload[0] == 7 && payloadBytesToInt(packet.payload + 3) == pattern;
+
+  bufferCreditsPayload_t credits;
+  credits.creditLimit = pattern;
+  payloadEncode(packet, credits);
+  bool creditsOk = (uint32_t) payloadDecode<bufferCreditsPayload_t>(packet).creditLimit == pattern && payloadBytesToInt(packet.payload) == pattern;
+
+  latencyReportPayload_t report;
+  report.tag = 0xA5;
+  report.slaveDelay = pattern;
+  payloadEncode(packet, report);
+  latencyReportPayload_t decodedReport = payloadDecode<latencyReportPayload_t>(packet);
+  bool reportOk = decodedReport.tag == 0xA5 && (uint32_t) decodedReport.slaveDelay == pattern && packet.payload[0] == 0xA5 && payloadBytesToInt(packet.payload + 1) == pattern;
+
+  payloadIntToBytes(pattern, packet.payload);
+  payloadIntToBytes(~pattern, packet.payload + 4);
+  streamResultsPayload_t decodedResults = payloadDecode<streamResultsPayload_t>(packet);
+  bool resultsOk = (uint32_t) decodedResults.checksum == pattern && (uint32_t) decodedResults.time == ~pattern;
+
+  consolePrintf("SLAVE_CAPABILITIES round trip: %s\n\r", results[capabilitiesOk]);
+  consolePrintf("BUFFER_CREDITS round trip: %s\n\r", results[creditsOk]);
+  consolePrintf("LATENCY_REPORT round trip: %s\n\r", results[reportOk]);
+  consolePrintf("STREAM_RESULTS decodes byte-packed payloads: %s\n\r", results[resultsOk]);
+
+  volatile uint32_t sink = 0; //keeps the loops from being optimised away
+  int64_t start = esp_timer_get_time();
+  for (uint32_t round = 0; round < PAYLOAD_BENCH_ROUNDS; round++){
+    streamResultsPayload_t fields;
+    fields.checksum = round;
+    fields.time = sink;
+    payloadEncode(packet, fields);
+    streamResultsPayload_t decoded = payloadDecode<streamResultsPayload_t>(packet);
+    sink = decoded.checksum + decoded.time;
+  }
+  int64_t structTime = esp_timer_get_time() - start;
+
+  start = esp_timer_get_time();
+  for (uint32_t round = 0; round < PAYLOAD_BENCH_ROUNDS; round++){
+    payloadIntToBytes(round, packet.payload);
+    payloadIntToBytes(sink, packet.payload + 4);
+    sink = payloadBytesToInt(packet.payload) + payloadBytesToInt(packet.payload + 4);
+  }
+  int64_t shiftTime = esp_timer_get_time() - start;
+
+  consolePrintf("Encode + decode x%d: structs %u us, byte shifts %u us\n\r", PAYLOAD_BENCH_ROUNDS, (uint32_t) structTime, (uint32_t) shiftTime);
+  return !capabilitiesOk + !creditsOk + !reportOk + !resultsOk;
+}
+
+#endif
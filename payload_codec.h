@@ -0,0 +1,68 @@
+#ifndef PAYLOAD_CODEC_H
+#define PAYLOAD_CODEC_H
+
+#include <BlueteethInternalNetworkStack.h>
+#include <string.h>
+
+//Byte order conversion between the host and the wire (multi-byte payload fields are little-endian on the wire)
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+inline uint16_t wireOrder(uint16_t value) { return __builtin_bswap16(value); }
+inline uint32_t wireOrder(uint32_t value) { return __builtin_bswap32(value); }
+inline int32_t wireOrder(int32_t value) { return (int32_t) __builtin_bswap32((uint32_t) value); }
+#else
+inline uint16_t wireOrder(uint16_t value) { return value; }
+inline uint32_t wireOrder(uint32_t value) { return value; }
+inline int32_t wireOrder(int32_t value) { return value; }
+#endif
+
+/*  A little-endian field inside a payload struct. It's stored as bytes, so payload structs have no padding and no alignment
+*   requirement, and reads and writes are a memcpy (plus a byte swap on big-endian hosts) with no per-byte shifting.
+*/
+template <typename T>
+struct littleEndian {
+  uint8_t bytes[sizeof(T)];
+
+  inline operator T() const {
+    T value;
+    memcpy(&value, bytes, sizeof(T));
+    return wireOrder(value);
+  }
+
+  inline littleEndian & operator=(T value){
+    value = wireOrder(value);
+    memcpy(bytes, &value, sizeof(T));
+    return *this;
+  }
+};
+
+typedef littleEndian<uint16_t> le16_t;
+typedef littleEndian<uint32_t> le32_t;
+typedef littleEndian<int32_t> les32_t;
+
+#define PACKET_PAYLOAD_SIZE (sizeof(BlueteethPacket::payload))
+
+/*  Copies a packet's payload into a payload struct
+*
+*   @packet - the received packet
+*   @return - the decoded payload
+*/
+template <typename T>
+inline T payloadDecode(const BlueteethPacket & packet){
+  static_assert(sizeof(T) <= PACKET_PAYLOAD_SIZE, "payload struct is larger than a packet payload");
+  T fields;
+  memcpy(&fields, packet.payload, sizeof(T));
+  return fields;
+}
+
+/*  Copies a payload struct into a packet's payload
+*
+*   @packet - the packet being built
+*   @fields - the payload
+*/
+template <typename T>
+inline void payloadEncode(BlueteethPacket & packet, const T & fields){
+  static_assert(sizeof(T) <= PACKET_PAYLOAD_SIZE, "payload struct is larger than a packet payload");
+  memcpy(packet.payload, &fields, sizeof(T));
+}
+
+#endif
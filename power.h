@@ -0,0 +1,175 @@
+#ifndef POWER_H
+#define POWER_H
+
+#include <Arduino.h>
+#include <atomic>
+#include <esp_pm.h>
+#include <esp_freertos_hooks.h>
+#include "stream_controller.h"
+#include "console.h"
+#include "logging.h"
+
+#define POWER_MAX_MHZ (240) //while streaming
+#define POWER_MIN_MHZ (80) //while idle (Bluetooth and the UARTs need the 80 MHz APB clock)
+#define POWER_IDLE_PERIOD_FACTOR (4) //periodic tasks run this many times less often while idle
+
+/*  Ties CPU frequency and light sleep to the stream state. With power management in the SDK, an esp_pm lock holds the
+*   maximum frequency while streaming and DFS does the rest; without it, the frequency is set directly. Light sleep also needs
+*   tickless idle, which stock Arduino builds leave out, so it's tracked separately from DFS. It's opt-in ("power sleep on"):
+*   the control-plane UART can't wake the chip, so the ring loses bytes while it sleeps.
+*   Busy time is sampled on every tick and returns to the idle task are counted as wakeups.
+*/
+typedef struct {
+  bool pmEnabled; //esp_pm_configure() succeeded
+  bool sleepAvailable; //and accepted light sleep
+  esp_pm_lock_handle_t cpuLock; //ESP_PM_CPU_FREQ_MAX
+  esp_pm_lock_handle_t sleepLock; //ESP_PM_NO_LIGHT_SLEEP
+  bool streaming; //the CPU lock is held (or the frequency raised)
+  bool allowSleep; //light sleep while idle
+  bool sleepLockHeld;
+  uint32_t transitions;
+  TaskHandle_t idleTasks[portNUM_PROCESSORS];
+  std::atomic<uint32_t> busyTicks[portNUM_PROCESSORS]; //ticks that interrupted something other than the idle task
+  std::atomic<uint32_t> wakeups[portNUM_PROCESSORS]; //times each core went back to idle
+  uint32_t windowStartTick; //xTaskGetTickCount() when the counters were last reset
+  uint32_t windowStartMs;
+  portMUX_TYPE lock; //the terminal and the packager both change the sleep lock
+} powerManager_t;
+
+extern powerManager_t powerManager;
+
+/*  Tick hook, samples whether the core was busy
+*
+*/
+inline void powerTickHook(){
+  uint32_t core = xPortGetCoreID();
+  if (xTaskGetCurrentTaskHandle() != powerManager.idleTasks[core]) powerManager.busyTicks[core].fetch_add(1, std::memory_order_relaxed);
+}
+
+/*  Idle hook, counts returns to idle (each one follows an interrupt or a task running)
+*
+*/
+inline bool powerIdleHook(){
+  powerManager.wakeups[xPortGetCoreID()].fetch_add(1, std::memory_order_relaxed);
+  return true; //let the core wait for the next interrupt
+}
+
+/*  Zeroes the duty cycle and wakeup counters
+*
+*/
+inline void powerResetStats(){
+  for (int core = 0; core < portNUM_PROCESSORS; core++){
+    powerManager.busyTicks[core].store(0, std::memory_order_relaxed);
+    powerManager.wakeups[core].store(0, std::memory_order_relaxed);
+  }
+  powerManager.windowStartTick = xTaskGetTickCount();
+  powerManager.windowStartMs = millis();
+}
+
+/*  Holds or drops the light sleep lock to match the stream state and setting
+*
+*/
+inline void powerApplySleep(){
+  if (!powerManager.pmEnabled || !powerManager.sleepAvailable) return;
+  portENTER_CRITICAL(&powerManager.lock);
+  bool hold = powerManager.streaming || !powerManager.allowSleep;
+  if (hold != powerManager.sleepLockHeld){
+    powerManager.sleepLockHeld = hold;
+    if (hold) esp_pm_lock_acquire(powerManager.sleepLock); //safe in a critical section, esp_pm locks can be taken from ISRs
+    else esp_pm_lock_release(powerManager.sleepLock);
+  }
+  portEXIT_CRITICAL(&powerManager.lock);
+}
+
+/*  Allows or blocks light sleep while the stream is idle
+*
+*   @allow - true to allow it
+*   @return - false if this SDK build can't light sleep
+*/
+inline bool powerAllowSleep(bool allow){
+  powerManager.allowSleep = allow;
+  powerApplySleep();
+  return powerManager.pmEnabled && powerManager.sleepAvailable;
+}
+
+/*  Enables power management if the SDK has it, creates the locks and registers the hooks. Starts in the idle setting.
+*   If light sleep is refused (no tickless idle), DFS and the CPU lock are configured without it.
+*
+*/
+inline void powerInit(){
+  powerManager.streaming = false;
+  powerManager.allowSleep = false;
+  powerManager.sleepLockHeld = false;
+  powerManager.transitions = 0;
+  powerManager.lock = portMUX_INITIALIZER_UNLOCKED;
+
+  esp_pm_config_esp32_t config;
+  config.max_freq_mhz = POWER_MAX_MHZ;
+  config.min_freq_mhz = POWER_MIN_MHZ;
+  config.light_sleep_enable = true;
+  powerManager.sleepAvailable = (esp_pm_configure(&config) == ESP_OK);
+  if (!powerManager.sleepAvailable){
+    config.light_sleep_enable = false;
+    LOG_INFO("Light sleep not in this SDK build, using DFS only");
+  }
+  powerManager.pmEnabled = (powerManager.sleepAvailable || esp_pm_configure(&config) == ESP_OK)
+    && (esp_pm_lock_create(ESP_PM_CPU_FREQ_MAX, 0, "stream", &powerManager.cpuLock) == ESP_OK)
+    && (esp_pm_lock_create(ESP_PM_NO_LIGHT_SLEEP, 0, "stream", &powerManager.sleepLock) == ESP_OK);
+  if (!powerManager.pmEnabled){
+    LOG_INFO("Power management not in this SDK build, switching CPU frequency directly");
+    setCpuFrequencyMhz(POWER_MIN_MHZ);
+  }
+  powerApplySleep();
+
+  for (int core = 0; core < portNUM_PROCESSORS; core++){
+    powerManager.idleTasks[core] = xTaskGetIdleTaskHandleForCPU(core);
+    esp_register_freertos_tick_hook_for_cpu(powerTickHook, core);
+    esp_register_freertos_idle_hook_for_cpu(powerIdleHook, core);
+  }
+  powerResetStats();
+}
+
+/*  Raises or lowers the power setting when the stream starts or stops. Only the packager calls this.
+*
+*   @state - the stream state
+*/
+inline void powerStreamState(streamState_t state){
+  bool streaming = (state != STREAM_IDLE);
+  if (streaming == powerManager.streaming) return;
+  powerManager.streaming = streaming;
+  powerManager.transitions++;
+
+  if (powerManager.pmEnabled){
+    if (streaming) esp_pm_lock_acquire(powerManager.cpuLock);
+    else esp_pm_lock_release(powerManager.cpuLock);
+    powerApplySleep();
+  }
+  else setCpuFrequencyMhz(streaming ? POWER_MAX_MHZ : POWER_MIN_MHZ);
+}
+
+/*  Gets how long a periodic task should sleep, stretched while the stream is idle so the CPU wakes less often
+*
+*   @periodMs - period while streaming
+*/
+inline uint32_t powerScaledPeriod(uint32_t periodMs){
+  return powerManager.streaming ? periodMs : periodMs * POWER_IDLE_PERIOD_FACTOR;
+}
+
+/*  Prints the power setting, each core's duty cycle and wakeups per second since the last reset
+*
+*/
+inline void printPower(){
+  uint32_t ticks = xTaskGetTickCount() - powerManager.windowStartTick;
+  uint32_t ms = millis() - powerManager.windowStartMs;
+  consolePrintf("%s, %s, CPU at %u MHz, light sleep %s, %u transitions\n\r", powerManager.pmEnabled ? "esp_pm" : "no esp_pm",
+    powerManager.streaming ? "streaming" : "idle", getCpuFrequencyMhz(), (!powerManager.pmEnabled || !powerManager.sleepAvailable) ? "unavailable" : (powerManager.sleepLockHeld ? "blocked" : "allowed"), powerManager.transitions);
+  consolePrintf("%-6s %10s %12s\n\r", "core", "duty %", "wakeups/s");
+  for (int core = 0; core < portNUM_PROCESSORS; core++){
+    uint32_t busy = powerManager.busyTicks[core].load(std::memory_order_relaxed);
+    uint32_t wakeups = powerManager.wakeups[core].load(std::memory_order_relaxed);
+    consolePrintf("%-6d %10u %12u\n\r", core, ticks ? (uint32_t) ((uint64_t) busy * 100 / ticks) : 0, ms ? (uint32_t) ((uint64_t) wakeups * 1000 / ms) : 0);
+  }
+  consolePrintf("over the last %u ms\n\r", ms);
+}
+
+#endif
@@ -0,0 +1,226 @@
+#ifndef SLAVE_TABLE_H
+#define SLAVE_TABLE_H
+
+#include <BlueteethInternalNetworkStack.h>
+#include <esp_timer.h>
+#include "packet_types.h"
+#include "console.h"
+
+#define MAX_SLAVES (32)
+#define FIRST_SLAVE_ADDRESS (1)
+#define BROADCAST_ADDRESS (255)
+#define ENUMERATION_BENCH_ROUNDS (100) //enumerations timed per ring size by "slaves bench"
+
+//Codec bitmask advertised by slaves
+#define CODEC_PCM_16 (1 << 0)
+#define CODEC_PCM_24 (1 << 1)
+#define CODEC_SBC (1 << 2)
+
+typedef struct {
+  uint8_t address;
+  uint8_t channels;
+  uint8_t codecs;
+  uint32_t maxBaud;
+} slaveInfo_t;
+
+/*  Table of slaves discovered on the ring. Entries are ordered by address, so a slave's index is (address - FIRST_SLAVE_ADDRESS),
+*   and the table can be sparse if a slave never reports. Per-slave state elsewhere in the sketch is stored in arrays of MAX_SLAVES
+*   entries indexed the same way (fixed, since nothing is allocated after boot), and every per-slave loop stops at numEntries.
+*   The reception task and the terminal write the table under its lock. Other tasks work from a copy (slaveTableCopy()).
+*/
+typedef struct {
+  slaveInfo_t slaves[MAX_SLAVES];
+  uint8_t numSlaves; //number of slaves that have reported their capabilities
+  uint8_t numEntries; //highest populated index + 1, the part of the table (and of per-slave state) in use
+  uint8_t expectedSlaves; //number of addresses handed out by the last enumeration (0 until the INITIALIZAITON packet returns)
+  uint32_t enumerationStart; //millis() when the last enumeration was started
+  uint32_t enumerationTime; //milliseconds from the start of enumeration until every slave had reported
+  volatile uint32_t version; //bumped on every change, so copies know when to refresh
+  portMUX_TYPE lock;
+} slaveTable_t;
+
+/*  Clears the slave table and marks the start of a new enumeration.
+*
+*   @table - the table being reset
+*/
+inline void resetSlaveTable(slaveTable_t & table){
+  portENTER_CRITICAL(&table.lock);
+  memset(table.slaves, 0, sizeof(table.slaves));
+  table.numSlaves = 0;
+  table.numEntries = 0;
+  table.expectedSlaves = 0;
+  table.enumerationStart = millis();
+  table.enumerationTime = 0;
+  table.version++;
+  portEXIT_CRITICAL(&table.lock);
+}
+
+/*  Sets up the lock and clears the table. Called once at boot, before any task uses it.
+*
+*   @table - the table
+*/
+inline void initSlaveTable(slaveTable_t & table){
+  table.lock = portMUX_INITIALIZER_UNLOCKED;
+  table.version = 0;
+  resetSlaveTable(table);
+}
+
+/*  Copies the table for a task that reads it without holding the lock
+*
+*   @table - the live table
+*   @copy - set to a consistent copy (its lock is left unlocked and unused)
+*/
+inline void slaveTableCopy(slaveTable_t & table, slaveTable_t & copy){
+  portENTER_CRITICAL(&table.lock);
+  memcpy(&copy, &table, offsetof(slaveTable_t, lock));
+  portEXIT_CRITICAL(&table.lock);
+  copy.lock = portMUX_INITIALIZER_UNLOCKED;
+}
+
+/*  Refreshes a long-lived copy of the table if the table has changed since
+*
+*   @table - the live table
+*   @copy - copy made by slaveTableCopy(), or zeroed (the live table's version is never 0 once it's initialized)
+*   @return - true if the copy was refreshed
+*/
+inline bool slaveTableRefresh(slaveTable_t & table, slaveTable_t & copy){
+  if (copy.version == table.version) return false;
+  slaveTableCopy(table, copy);
+  return true;
+}
+
+/*  Gets the slave table index for an address
+*
+*   @address - address of the slave
+*   @return - index into the table, or -1 if the address is outside the assignable range
+*/
+inline int slaveIndex(uint8_t address){
+  if (address < FIRST_SLAVE_ADDRESS || address >= FIRST_SLAVE_ADDRESS + MAX_SLAVES) return -1;
+  return address - FIRST_SLAVE_ADDRESS;
+}
+
+/*  Records a slave's capabilities. Each slave reports once per enumeration, so this is O(1) per slave and enumeration grows linearly with the ring.
+*
+*   @table - the table being updated
+*   @info - capabilities reported by the slave
+*   @return - true if the entry was recorded
+*/
+inline bool recordSlave(slaveTable_t & table, const slaveInfo_t & info){
+  int idx = slaveIndex(info.address);
+  if (idx < 0) return false;
+  portENTER_CRITICAL(&table.lock);
+  if (table.slaves[idx].address == 0) table.numSlaves++;
+  table.slaves[idx] = info;
+  if (idx >= table.numEntries) table.numEntries = idx + 1;
+  if (table.expectedSlaves != 0 && table.numSlaves == table.expectedSlaves) table.enumerationTime = millis() - table.enumerationStart;
+  table.version++;
+  portEXIT_CRITICAL(&table.lock);
+  return true;
+}
+
+/*  Records how many addresses were assigned once the INITIALIZAITON packet has made it around the ring.
+*
+*   @table - the table being updated
+*   @nextAddress - the address the INITIALIZAITON packet would have assigned next
+*/
+inline void finishEnumeration(slaveTable_t & table, uint8_t nextAddress){
+  int assigned = nextAddress - FIRST_SLAVE_ADDRESS;
+  portENTER_CRITICAL(&table.lock);
+  table.expectedSlaves = (assigned < 0) ? 0 : ((assigned > MAX_SLAVES) ? MAX_SLAVES : assigned);
+  if (table.numSlaves == table.expectedSlaves) table.enumerationTime = millis() - table.enumerationStart;
+  table.version++;
+  portEXIT_CRITICAL(&table.lock);
+}
+
+/*  Checks whether an entry in the table is populated
+*
+*   @table - the table being checked
+*   @idx - index into the table
+*/
+inline bool slavePresent(const slaveTable_t & table, int idx){
+  return table.slaves[idx].address != 0;
+}
+
+/*  Gets the number of table entries per-slave loops have to visit
+*
+*   @table - the table
+*/
+inline int slaveEntries(const slaveTable_t & table){
+  return table.numEntries;
+}
+
+/*  Lists the address of every slave in the table
+*
+*   @table - the live table
+*   @addresses - MAX_SLAVES entries, filled in table order
+*   @return - number of addresses written
+*/
+inline int slaveAddresses(slaveTable_t & table, uint8_t * addresses){
+  int count = 0;
+  portENTER_CRITICAL(&table.lock);
+  for (int idx = 0; idx < slaveEntries(table); idx++){
+    if (slavePresent(table, idx)) addresses[count++] = table.slaves[idx].address;
+  }
+  portEXIT_CRITICAL(&table.lock);
+  return count;
+}
+
+/*  Prints every slave in the table along with its capabilities
+*
+*   @table - the table being printed
+*/
+inline void printSlaveTable(const slaveTable_t & table){
+  consolePrintf("%d of %d slaves reported", table.numSlaves, table.expectedSlaves);
+  if (table.enumerationTime) consolePrintf(" (enumeration took %d ms)", table.enumerationTime);
+  consolePrint("\n\r");
+  for (int idx = 0; idx < slaveEntries(table); idx++){
+    if (!slavePresent(table, idx)) continue;
+    const slaveInfo_t & slave = table.slaves[idx];
+    consolePrintf("ADDR%d: %d channel(s), codecs 0x%02x, max baud %u\n\r", slave.address, slave.channels, slave.codecs, slave.maxBaud);
+  }
+}
+
+/*  Times the master's side of enumerating rings of 1 to @maxNodes slaves (reset, every capability report, the returning
+*   INITIALIZAITON packet) on a scratch table, to check the cost grows linearly with the ring. Time on the wire isn't included.
+*   For each ring it also times what the packager does with the table every burst: slaveTableRefresh() when the table has
+*   changed (the locked copy-out) and when it hasn't (just the version check).
+*
+*   @maxNodes - largest ring size (at most MAX_SLAVES)
+*/
+inline void benchEnumeration(int maxNodes){
+  slaveTable_t scratch;
+  slaveTable_t copy;
+  slaveInfo_t info = {0, 2, CODEC_PCM_16, 115200};
+  initSlaveTable(scratch);
+  consolePrintf("%-6s %12s %12s %12s %12s\n\r", "nodes", "us/ring", "ns/node", "ns/copy-out", "ns/check");
+  for (int nodes = 1; nodes <= maxNodes; nodes++){
+    int64_t start = esp_timer_get_time();
+    for (int round = 0; round < ENUMERATION_BENCH_ROUNDS; round++){
+      resetSlaveTable(scratch);
+      for (int idx = 0; idx < nodes; idx++){
+        info.address = FIRST_SLAVE_ADDRESS + idx;
+        recordSlave(scratch, info);
+      }
+      finishEnumeration(scratch, FIRST_SLAVE_ADDRESS + nodes);
+    }
+    uint32_t elapsed = esp_timer_get_time() - start;
+
+    start = esp_timer_get_time();
+    for (int round = 0; round < ENUMERATION_BENCH_ROUNDS; round++){
+      copy.version = 0; //stale, like the packager's copy after enumeration changes the table
+      slaveTableRefresh(scratch, copy);
+    }
+    uint32_t copyElapsed = esp_timer_get_time() - start;
+
+    start = esp_timer_get_time();
+    for (int round = 0; round < ENUMERATION_BENCH_ROUNDS; round++) slaveTableRefresh(scratch, copy);
+    uint32_t checkElapsed = esp_timer_get_time() - start;
+
+    consolePrintf("%-6d %12u %12u %12u %12u\n\r", nodes, elapsed / ENUMERATION_BENCH_ROUNDS, (uint32_t) ((uint64_t) elapsed * 1000 / ENUMERATION_BENCH_ROUNDS / nodes),
+      (uint32_t) ((uint64_t) copyElapsed * 1000 / ENUMERATION_BENCH_ROUNDS), (uint32_t) ((uint64_t) checkElapsed * 1000 / ENUMERATION_BENCH_ROUNDS));
+    if (slaveEntries(copy) != nodes) consolePrint("Copy-out lost entries, the packager would skip slaves\n\r");
+  }
+  if (scratch.numSlaves != maxNodes || scratch.expectedSlaves != maxNodes) consolePrint("Scratch table didn't end up complete, enumeration is broken\n\r");
+}
+
+#endif
\ No newline at end of file
@@ -0,0 +1,194 @@
+#ifndef STATIC_ALLOCATION_H
+#define STATIC_ALLOCATION_H
+
+#include <Arduino.h>
+
+//Set to 1 to build with every task and semaphore statically allocated and trip an assertion if a sketch task allocates after setup().
+//It has to be a global build define (-DSTATIC_ALLOCATION=1 in the build flags), not a #define in the sketch, or memory_profiling.cpp's
+//operator new is built without the check; memoryCheckBuildFlags() stops boot if the two disagree.
+#ifndef STATIC_ALLOCATION
+#define STATIC_ALLOCATION (0)
+#endif
+
+#define TASK_STACK_SIZE (4096) //bytes (StackType_t is a byte on the ESP32)
+#define MAX_STATIC_TASKS (9)
+#define BLOCK_POOL_BLOCK_SIZE (512) //bytes, what libstdc++'s deque<uint8_t> allocates per block
+#define BLOCK_POOL_BLOCKS (12) //a full data plane frame spans at most 9 deque blocks, plus the deque's map (old and new while it regrows)
+
+/*  Fixed storage that operator new takes blocks from while a task is inside a USE_BLOCK_POOL scope. This is how deques the
+*   sketch owns get fixed storage without changing their type (packDataStream only accepts std::deque<uint8_t>).
+*/
+typedef struct {
+  uint8_t blocks[BLOCK_POOL_BLOCKS][BLOCK_POOL_BLOCK_SIZE] __attribute__((aligned(8)));
+  uint32_t freeMask; //bit n set while blocks[n] is free
+  uint32_t fallbacks; //requests that were too big or found the pool empty, and went to the heap
+  portMUX_TYPE lock;
+} blockPool_t;
+
+extern volatile bool heapLocked; //set once setup() has finished
+extern thread_local uint8_t heapExemptDepth; //non-zero while a task is inside a HEAP_EXEMPT scope
+extern thread_local blockPool_t * activeBlockPool; //pool operator new uses for the current task, NULL for the heap
+extern blockPool_t stagingPool; //the packager's frame staging deque
+
+#if STATIC_ALLOCATION
+extern StackType_t staticTaskStacks[MAX_STATIC_TASKS][TASK_STACK_SIZE];
+extern StaticTask_t staticTaskBuffers[MAX_STATIC_TASKS];
+extern uint32_t staticTasksUsed;
+extern portMUX_TYPE staticTasksLock; //tasks are created from both cores during boot
+
+/*  Claims a slot in the static task pool
+*
+*   @stackDepth - stack size the task needs
+*   @return - the slot, or -1 if the pool is used up or the stack is too big
+*/
+inline int claimStaticTask(uint32_t stackDepth){
+  if (stackDepth > TASK_STACK_SIZE) return -1;
+  portENTER_CRITICAL(&staticTasksLock);
+  int slot = (staticTasksUsed < MAX_STATIC_TASKS) ? staticTasksUsed++ : -1;
+  portEXIT_CRITICAL(&staticTasksLock);
+  return slot;
+}
+#endif
+
+/*  Creates a task, from the static task pool when STATIC_ALLOCATION is set
+*
+*   @function - task function
+*   @name - task name
+*   @stackDepth - stack size in bytes (at most TASK_STACK_SIZE in static builds)
+*   @params - argument passed to the task
+*   @priority - task priority
+*   @handle - set to the new task's handle
+*   @return - pdPASS if the task was created
+*/
+inline BaseType_t createTask(TaskFunction_t function, const char * name, uint32_t stackDepth, void * params, UBaseType_t priority, TaskHandle_t * handle){
+#if STATIC_ALLOCATION
+  int slot = claimStaticTask(stackDepth);
+  if (slot < 0) return pdFAIL;
+  *handle = xTaskCreateStatic(function, name, stackDepth, params, priority, staticTaskStacks[slot], &staticTaskBuffers[slot]);
+  return (*handle != NULL) ? pdPASS : pdFAIL;
+#else
+  return xTaskCreate(function, name, stackDepth, params, priority, handle);
+#endif
+}
+
+/*  Creates a task pinned to one core, from the static task pool when STATIC_ALLOCATION is set
+*
+*   @function - task function
+*   @name - task name
+*   @stackDepth - stack size in bytes (at most TASK_STACK_SIZE in static builds)
+*   @params - argument passed to the task
+*   @priority - task priority
+*   @handle - set to the new task's handle
+*   @core - core to run on
+*   @return - pdPASS if the task was created
+*/
+inline BaseType_t createTaskPinned(TaskFunction_t function, const char * name, uint32_t stackDepth, void * params, UBaseType_t priority, TaskHandle_t * handle, BaseType_t core){
+#if STATIC_ALLOCATION
+  int slot = claimStaticTask(stackDepth);
+  if (slot < 0) return pdFAIL;
+  *handle = xTaskCreateStaticPinnedToCore(function, name, stackDepth, params, priority, staticTaskStacks[slot], &staticTaskBuffers[slot], core);
+  return (*handle != NULL) ? pdPASS : pdFAIL;
+#else
+  return xTaskCreatePinnedToCore(function, name, stackDepth, params, priority, handle, core);
+#endif
+}
+
+/*  Creates a mutex, in static storage when STATIC_ALLOCATION is set
+*
+*   @buffer - storage for the mutex (only used in static builds)
+*   @return - the mutex handle
+*/
+inline SemaphoreHandle_t createMutex(StaticSemaphore_t * buffer){
+#if STATIC_ALLOCATION
+  return xSemaphoreCreateMutexStatic(buffer);
+#else
+  return xSemaphoreCreateMutex();
+#endif
+}
+
+/*  Creates a queue, in caller-provided storage when STATIC_ALLOCATION is set
+*
+*   @length - maximum number of items
+*   @itemSize - size of each item in bytes
+*   @storage - length * itemSize bytes of storage (only used in static builds)
+*   @buffer - storage for the queue's control block (only used in static builds)
+*   @return - the queue handle
+*/
+inline QueueHandle_t createQueue(UBaseType_t length, UBaseType_t itemSize, uint8_t * storage, StaticQueue_t * buffer){
+#if STATIC_ALLOCATION
+  return xQueueCreateStatic(length, itemSize, storage, buffer);
+#else
+  return xQueueCreate(length, itemSize);
+#endif
+}
+
+/*  Takes a block from the current task's block pool
+*
+*   @size - bytes requested
+*   @return - the block, or NULL if there's no pool in scope, the request is too big or the pool is empty
+*/
+inline void * blockPoolAllocate(size_t size){
+  blockPool_t * pool = activeBlockPool;
+  if (pool == NULL) return NULL;
+  void * block = NULL;
+  portENTER_CRITICAL(&pool->lock);
+  if (size <= BLOCK_POOL_BLOCK_SIZE && pool->freeMask){
+    int idx = __builtin_ctz(pool->freeMask);
+    pool->freeMask &= ~(1u << idx);
+    block = pool->blocks[idx];
+  }
+  else pool->fallbacks++;
+  portEXIT_CRITICAL(&pool->lock);
+  return block;
+}
+
+/*  Returns a block to its pool. Safe to call from any task, with or without a pool in scope.
+*
+*   @pool - the pool
+*   @ptr - the memory being freed
+*   @return - false if @ptr didn't come from @pool
+*/
+inline bool blockPoolFree(blockPool_t & pool, void * ptr){
+  uint8_t * start = &pool.blocks[0][0];
+  if ((uint8_t *) ptr < start || (uint8_t *) ptr >= start + sizeof(pool.blocks)) return false;
+  uint32_t idx = ((uint8_t *) ptr - start) / BLOCK_POOL_BLOCK_SIZE;
+  portENTER_CRITICAL(&pool.lock);
+  pool.freeMask |= (1u << idx);
+  portEXIT_CRITICAL(&pool.lock);
+  return true;
+}
+
+/*  Gets the number of blocks currently handed out
+*
+*   @pool - the pool
+*/
+inline int blockPoolInUse(const blockPool_t & pool){
+  return BLOCK_POOL_BLOCKS - __builtin_popcount(pool.freeMask);
+}
+
+/*  Sends the current scope's allocations to a block pool. Anything the pool can't serve still goes to the heap (and trips
+*   heapCheckAllocation in static builds), so a pool that's too small shows up instead of hiding behind HEAP_EXEMPT.
+*/
+class blockPoolScope {
+  public:
+    inline blockPoolScope(blockPool_t & pool) : previous(activeBlockPool) { activeBlockPool = &pool; }
+    inline ~blockPoolScope() { activeBlockPool = previous; }
+  private:
+    blockPool_t * previous;
+};
+
+#define USE_BLOCK_POOL(pool) blockPoolScope blockPoolGuard(pool)
+#define BLOCK_POOL_INITIALIZER {{}, (1u << BLOCK_POOL_BLOCKS) - 1, 0, portMUX_INITIALIZER_UNLOCKED}
+
+/*  Lets the current scope allocate after boot. Only used around library-owned memory that can't be given a fixed pool from
+*   here: the network stack's dataBuffer, and the Bluetooth and NVS layers.
+*/
+class heapExemptScope {
+  public:
+    inline heapExemptScope() { heapExemptDepth++; }
+    inline ~heapExemptScope() { heapExemptDepth--; }
+};
+
+#define HEAP_EXEMPT() heapExemptScope heapExempt
+
+#endif
\ No newline at end of file
@@ -0,0 +1,156 @@
+#ifndef STREAM_BUFFER_H
+#define STREAM_BUFFER_H
+
+#include <BlueteethInternalNetworkStack.h>
+#include "data_plane_routing.h"
+#include "console.h"
+
+#define STREAM_BUFFER_CAPACITY (32768) //hard limit on dataBuffer (~185 ms of 44.1 kHz 16 bit stereo)
+#define STREAM_BUFFER_HIGH_WATERMARK (24576) //overload handling starts here
+#define STREAM_BUFFER_LOW_WATERMARK (8192) //and stops here
+#define DECIMATION_INTERVAL (32) //while decimating, one stereo sample in this many is dropped (~3% faster drain)
+
+typedef enum {
+  DROP_OLDEST, //skip ahead to the low watermark once the high watermark is crossed (restores latency in one glitch)
+  DROP_NEWEST, //discard incoming data until the buffer drains to the low watermark
+  DECIMATE //drop single stereo samples spread across the incoming data until the low watermark is reached (no resampling, so it can click)
+} overloadPolicy_t;
+
+typedef struct {
+  size_t capacity;
+  size_t highWatermark;
+  size_t lowWatermark;
+  overloadPolicy_t policy;
+  volatile bool overloaded; //set when the high watermark is crossed, cleared at the low watermark
+  volatile bool protect; //a job's pattern is buffered, so the packager mustn't drop from the front (see streamBufferProtect)
+  uint32_t decimationPhase; //position within the current DECIMATION_INTERVAL
+  size_t peakDepth;
+  volatile uint32_t droppedBytes;
+  volatile uint32_t overflowEvents; //number of times the high watermark was crossed
+} streamBuffer_t;
+
+/*  Sets up the stream buffer with the default capacity, watermarks and policy
+*
+*   @sb - the stream buffer state
+*/
+inline void streamBufferInit(streamBuffer_t & sb){
+  memset(&sb, 0, sizeof(sb));
+  sb.capacity = STREAM_BUFFER_CAPACITY;
+  sb.highWatermark = STREAM_BUFFER_HIGH_WATERMARK;
+  sb.lowWatermark = STREAM_BUFFER_LOW_WATERMARK;
+  sb.policy = DECIMATE;
+}
+
+/*  Updates the overload flag from the current buffer depth
+*
+*   @sb - the stream buffer state
+*   @depth - number of bytes currently buffered
+*/
+inline void streamBufferUpdateOverload(streamBuffer_t & sb, size_t depth){
+  if (depth > sb.peakDepth) sb.peakDepth = depth;
+  if (!sb.overloaded && depth >= sb.highWatermark){
+    sb.overloaded = true;
+    sb.overflowEvents++;
+  }
+  else if (sb.overloaded && depth <= sb.lowWatermark){
+    sb.overloaded = false;
+  }
+}
+
+/*  Appends incoming audio to the buffer according to the overload policy (producer side, called from the A2DP callback).
+*   Whatever the policy, nothing is buffered past the capacity, so memory use stays bounded.
+*
+*   @sb - the stream buffer state
+*   @buffer - the buffer feeding the data plane
+*   @data - incoming bytes
+*   @length - number of incoming bytes
+*   @return - number of bytes actually buffered
+*/
+inline size_t streamBufferWrite(streamBuffer_t & sb, std::deque<uint8_t> & buffer, const uint8_t * data, uint32_t length){
+  size_t depth = buffer.size();
+  size_t space = (depth < sb.capacity) ? sb.capacity - depth : 0;
+  size_t written = 0;
+
+  streamBufferUpdateOverload(sb, depth);
+
+  if (sb.overloaded && sb.policy == DROP_NEWEST){
+    sb.droppedBytes += length;
+    return 0;
+  }
+
+  if (sb.overloaded && sb.policy == DECIMATE){
+    for (uint32_t i = 0; i + STEREO_FRAME_BYTES <= length && written + STEREO_FRAME_BYTES <= space; i += STEREO_FRAME_BYTES){
+      if (++sb.decimationPhase >= DECIMATION_INTERVAL){
+        sb.decimationPhase = 0;
+        continue;
+      }
+      buffer.insert(buffer.end(), data + i, data + i + STEREO_FRAME_BYTES);
+      written += STEREO_FRAME_BYTES;
+    }
+  }
+  else {
+    written = min((size_t) length, (space / STEREO_FRAME_BYTES) * STEREO_FRAME_BYTES);
+    buffer.insert(buffer.end(), data, data + written);
+  }
+
+  sb.droppedBytes += length - written;
+  return written;
+}
+
+/*  Appends bytes that mustn't be altered (the stream and test jobs' patterns), up to the capacity. The overload policy
+*   isn't applied and overload isn't armed, so the caller waits for the packager to make room and writes the rest later.
+*
+*   @sb - the stream buffer state
+*   @buffer - the buffer feeding the data plane
+*   @data - bytes to append
+*   @length - number of bytes
+*   @return - number of bytes actually buffered
+*/
+inline size_t streamBufferFill(streamBuffer_t & sb, std::deque<uint8_t> & buffer, const uint8_t * data, size_t length){
+  size_t depth = buffer.size();
+  size_t written = min(length, (depth < sb.capacity) ? sb.capacity - depth : (size_t) 0);
+  buffer.insert(buffer.end(), data, data + written);
+  if (depth + written > sb.peakDepth) sb.peakDepth = depth + written;
+  return written;
+}
+
+/*  Holds off the drop-oldest policy while a job's data is in the buffer, so A2DP data arriving at the same time can't
+*   get the job's pattern erased. Incoming A2DP data is still dropped or decimated as usual.
+*
+*   @sb - the stream buffer state
+*   @protect - true while the job's data is buffered
+*/
+inline void streamBufferProtect(streamBuffer_t & sb, bool protect){
+  sb.protect = protect;
+}
+
+/*  Applies the drop-oldest policy (consumer side, called by the packager while it owns the front of the buffer)
+*
+*   @sb - the stream buffer state
+*   @buffer - the buffer feeding the data plane
+*   @return - number of bytes dropped from the front of the buffer
+*/
+inline size_t streamBufferService(streamBuffer_t & sb, std::deque<uint8_t> & buffer){
+  size_t depth = buffer.size();
+  streamBufferUpdateOverload(sb, depth);
+  if (!sb.overloaded || sb.policy != DROP_OLDEST || sb.protect) return 0;
+
+  size_t excess = ((depth - sb.lowWatermark) / STEREO_FRAME_BYTES) * STEREO_FRAME_BYTES;
+  buffer.erase(buffer.begin(), buffer.begin() + excess);
+  sb.droppedBytes += excess;
+  sb.overloaded = false;
+  return excess;
+}
+
+/*  Prints the stream buffer configuration and counters
+*
+*   @sb - the stream buffer state
+*   @depth - number of bytes currently buffered
+*/
+inline void printStreamBuffer(const streamBuffer_t & sb, size_t depth){
+  const char * policies[] = {"drop-oldest", "drop-newest", "decimate"};
+  consolePrintf("Depth %u / %u bytes (peak %u), watermarks %u-%u, policy %s\n\r", depth, sb.capacity, sb.peakDepth, sb.lowWatermark, sb.highWatermark, policies[sb.policy]);
+  consolePrintf("Overflow events: %u, dropped bytes: %u\n\r", sb.overflowEvents, sb.droppedBytes);
+}
+
+#endif
\ No newline at end of file
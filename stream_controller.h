@@ -0,0 +1,164 @@
+#ifndef STREAM_CONTROLLER_H
+#define STREAM_CONTROLLER_H
+
+#include <BlueteethInternalNetworkStack.h>
+#include "data_plane_routing.h"
+#include "static_allocation.h"
+#include "console.h"
+
+#define STREAM_PREBUFFER_DEPTH (2048) //bytes buffered before the first frame goes out (~12 ms of 44.1 kHz 16 bit stereo)
+#define STREAM_MIN_BURST (512) //while streaming, wait until at least this much is buffered before sending
+#define STREAM_DRAIN_TIMEOUT_MS (100) //no A2DP data for this long means the source paused
+#define STREAM_PREBUFFER_TIMEOUT_MS (250) //a short clip that never fills the prebuffer is sent anyway after this long
+
+typedef enum {
+  STREAM_IDLE, //nothing buffered, packager blocked, buffer memory released
+  STREAM_PREBUFFERING, //data arriving, waiting for prebufferDepth before sending anything
+  STREAM_STREAMING, //sending bursts as data arrives
+  STREAM_DRAINING, //source stopped, sending whatever is left
+  NUM_STREAM_STATES
+} streamState_t;
+
+/*  Owns the lifecycle of the data stream. The A2DP callback reports data and pauses, the packager asks whether it should send,
+*   and every transition is timestamped so start-up latency can be measured.
+*/
+typedef struct {
+  volatile streamState_t state;
+  size_t prebufferDepth;
+  volatile uint32_t lastDataTime; //millis() of the last data received
+  uint32_t transitionTime[NUM_STREAM_STATES]; //micros() of the last entry into each state
+  uint32_t startupLatency; //micros from leaving idle to the first frame being sent
+  uint32_t transitions;
+  TaskHandle_t packager; //task notified when there's something to do
+  portMUX_TYPE lock;
+} streamController_t;
+
+/*  Sets up the controller in the idle state
+*
+*   @sc - stream controller
+*   @packager - task that sends the data stream (NULL until it's created, nothing is notified until then)
+*/
+inline void streamControllerInit(streamController_t & sc, TaskHandle_t packager){
+  memset(&sc, 0, sizeof(sc));
+  sc.state = STREAM_IDLE;
+  sc.prebufferDepth = STREAM_PREBUFFER_DEPTH;
+  sc.packager = packager;
+  sc.lock = portMUX_INITIALIZER_UNLOCKED;
+  sc.transitionTime[STREAM_IDLE] = micros();
+}
+
+/*  Moves to a new state if the controller is still in the expected one (caller must hold sc.lock)
+*
+*   @sc - stream controller
+*   @from - state the transition starts from
+*   @to - state being entered
+*   @return - true if the transition happened
+*/
+inline bool streamControllerTransition(streamController_t & sc, streamState_t from, streamState_t to){
+  if (sc.state != from) return false;
+  sc.state = to;
+  sc.transitionTime[to] = micros();
+  sc.transitions++;
+  if (to == STREAM_STREAMING && from == STREAM_PREBUFFERING) sc.startupLatency = sc.transitionTime[STREAM_STREAMING] - sc.transitionTime[STREAM_PREBUFFERING];
+  return true;
+}
+
+/*  Reports new data in the stream buffer (producer side). The packager is only woken when the state changes or the buffer
+*   crosses the depth it's waiting for, not on every callback; a packager that's already sending re-checks the depth itself.
+*
+*   @sc - stream controller
+*   @written - number of bytes just added
+*   @depth - bytes buffered after adding them (read under dataBufferMutex)
+*/
+inline void streamControllerDataReceived(streamController_t & sc, size_t written, size_t depth){
+  sc.lastDataTime = millis();
+  portENTER_CRITICAL(&sc.lock);
+  bool wake = streamControllerTransition(sc, STREAM_IDLE, STREAM_PREBUFFERING);
+  wake |= streamControllerTransition(sc, STREAM_DRAINING, STREAM_STREAMING);
+  size_t threshold = (sc.state == STREAM_PREBUFFERING) ? sc.prebufferDepth : STREAM_MIN_BURST;
+  wake |= (depth >= threshold && depth - written < threshold);
+  TaskHandle_t packager = sc.packager;
+  portEXIT_CRITICAL(&sc.lock);
+  if (wake && packager != NULL) xTaskNotifyGive(packager);
+}
+
+/*  Asks the packager to send everything that's buffered and go idle (source paused or a test chunk finished)
+*
+*   @sc - stream controller
+*/
+inline void streamControllerRequestDrain(streamController_t & sc){
+  portENTER_CRITICAL(&sc.lock);
+  if (!streamControllerTransition(sc, STREAM_STREAMING, STREAM_DRAINING)) streamControllerTransition(sc, STREAM_PREBUFFERING, STREAM_DRAINING);
+  TaskHandle_t packager = sc.packager;
+  portEXIT_CRITICAL(&sc.lock);
+  if (packager != NULL) xTaskNotifyGive(packager);
+}
+
+/*  Decides whether the packager should send a burst now (consumer side). Releases the buffer's memory on the way to idle.
+*
+*   @sc - stream controller
+*   @buffer - the buffer feeding the data plane (caller must hold dataBufferMutex, which every producer also takes)
+*   @waitTicks - set to how long the packager should block if nothing should be sent
+*   @return - true if a burst should be sent
+*/
+inline bool streamControllerReady(streamController_t & sc, std::deque<uint8_t> & buffer, TickType_t & waitTicks){
+  size_t depth = buffer.size();
+  bool ready = false;
+  waitTicks = portMAX_DELAY;
+
+  portENTER_CRITICAL(&sc.lock);
+  switch (sc.state){
+
+    case STREAM_PREBUFFERING:
+      if (millis() - sc.lastDataTime > STREAM_PREBUFFER_TIMEOUT_MS){ //the source stopped short of the prebuffer depth
+        streamControllerTransition(sc, STREAM_PREBUFFERING, STREAM_DRAINING);
+        ready = (depth >= STEREO_FRAME_BYTES);
+      }
+      else {
+        ready = (depth >= sc.prebufferDepth) && streamControllerTransition(sc, STREAM_PREBUFFERING, STREAM_STREAMING);
+        waitTicks = pdMS_TO_TICKS(STREAM_PREBUFFER_TIMEOUT_MS); //wake up to flush a short clip if no more data shows up
+      }
+      break;
+
+    case STREAM_STREAMING:
+      if (millis() - sc.lastDataTime > STREAM_DRAIN_TIMEOUT_MS){
+        streamControllerTransition(sc, STREAM_STREAMING, STREAM_DRAINING);
+        ready = (depth >= STEREO_FRAME_BYTES);
+      }
+      else {
+        ready = (depth >= STREAM_MIN_BURST);
+        waitTicks = pdMS_TO_TICKS(STREAM_DRAIN_TIMEOUT_MS); //wake up to notice a pause even if no more data shows up
+      }
+      break;
+
+    case STREAM_DRAINING:
+      ready = (depth >= STEREO_FRAME_BYTES);
+      break;
+
+    default:
+      break;
+  }
+  bool release = !ready && streamControllerTransition(sc, STREAM_DRAINING, STREAM_IDLE);
+  portEXIT_CRITICAL(&sc.lock);
+
+  if (release){
+    HEAP_EXEMPT(); //an empty deque allocates its map
+    std::deque<uint8_t>().swap(buffer); //give the buffer's blocks back to the heap while idle (safe, producers hold the same mutex)
+  }
+  return ready;
+}
+
+/*  Prints the stream state and the most recent transition timestamps
+*
+*   @sc - stream controller
+*/
+inline void printStreamController(const streamController_t & sc){
+  const char * names[] = {"idle", "prebuffering", "streaming", "draining"};
+  consolePrintf("Stream state: %s (prebuffer depth %u bytes, %u transitions)\n\r", names[sc.state], sc.prebufferDepth, sc.transitions);
+  for (int state = 0; state < NUM_STREAM_STATES; state++){
+    consolePrintf("  entered %s at %u us\n\r", names[state], sc.transitionTime[state]);
+  }
+  consolePrintf("Start-up latency: %u us\n\r", sc.startupLatency);
+}
+
+#endif
\ No newline at end of file
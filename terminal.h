@@ -1,21 +1,74 @@
 #define MAX_BUFFER_SIZE (100)
-#define MAX_ARGS (4)
+#define MAX_ARGS (MAX_BUFFER_SIZE / 2) //enough for every token a full input line can hold
 #define NUM_PERSISTENT_LINES 8
+#define COMMAND_INDEX_SIZE (64) //hash buckets for command lookup (power of 2, more than twice the number of commands)
+#define NO_COMMAND (0xFF)
 
 #include "BlueteethInternalNetworkStack.h"
+#include "slave_table.h"
+#include "packet_types.h"
+#include "data_plane_routing.h"
+#include "flow_control.h"
+#include "stream_buffer.h"
+#include "stream_controller.h"
+#include "metrics.h"
+#include "tracing.h"
+#include "latency.h"
+#include "memory_profiling.h"
+#include "packet_dispatch.h"
+#include "console.h"
+#include "jobs.h"
+#include "bench.h"
+#include "bluetooth_scanning.h"
+#include "fast_reconnect.h"
+#include "boot.h"
+#include "power.h"
+
+extern slaveTable_t slaveTable;
+extern routingTable_t routingTable;
+extern flowControl_t flowControl;
+extern streamBuffer_t streamBuffer;
+extern streamController_t streamController;
+extern latencyTracker_t latencyTracker;
+extern BlueteethMasterStack internalNetworkStack;
 
 typedef struct {
   int scanIdx;
+  uint32_t blastCount;
 } terminalParameters_t;
 
+typedef PacketType (*commandHandler_t)(char ** arguments, uint8_t num_args, terminalParameters_t & terminalParameters);
+
+typedef struct {
+  const char * name;
+  uint32_t hash; //commandHash(name), computed at compile time
+  uint8_t minArgs; //argument counts include the command name itself
+  uint8_t maxArgs;
+  const char * usage; //shown by help and when the argument count is wrong
+  const char * help;
+  commandHandler_t handler;
+} terminalCommand_t;
+
+extern uint8_t commandIndex[COMMAND_INDEX_SIZE];
+
+//Name: commandHash
+//Purpose: FNV-1a hash of a command name. constexpr so the command table's hashes are computed by the compiler.
+//Inputs: name (C string), hash (running hash, leave as default)
+//Outputs: the hash
+constexpr uint32_t commandHash(const char * name, uint32_t hash = 2166136261u){
+  return (*name == '\0') ? hash : commandHash(name + 1, (hash ^ (uint8_t) *name) * 16777619u);
+}
+
+#define COMMAND(name, minArgs, maxArgs, usage, help, handler) {name, commandHash(name), minArgs, maxArgs, usage, help, handler}
+
 //Name: format_terminal_for_new_entry
 //Purpose: 
 //Inputs: 
 //Outputs: 
 inline void format_terminal_for_new_entry(int numEntries){
   for (int i = 0; i < numEntries; i++){
-    Serial.print("\0337"); //save cursor positon
-    Serial.printf("\033[%dF", numEntries);
+    consolePrint("\0337"); //save cursor positon
+    consolePrintf("\033[%dF", numEntries);
   }
 }
 
@@ -24,7 +77,7 @@ inline void format_terminal_for_new_entry(int numEntries){
 //Inputs: 
 //Outputs: 
 inline void format_new_terminal_entry(){
-    Serial.print("\0338"); //restore cursor position
+    consolePrint("\0338"); //restore cursor position
 }
 
 //Name: clear_buffer
@@ -37,124 +90,389 @@ inline void clear_buffer(char * buffer, int buffer_entries){
     }
 }
 
-//Name: argument_mapping
-//Purpose: map arguments to corresponding actions.
-//Inputs: char * arguments (array of pointers to argument strings), num_args (the number of actual arguments received)  
-//Outputs: action (the action that should be performed based on argument mapping)
-PacketType argument_mapping(char * arguments[MAX_ARGS], uint8_t num_args, terminalParameters_t & terminalParameters){
+//Command handlers. Each gets the tokenized input (arguments[0] is the command name) and returns the action the terminal task should perform.
 
-    if (0 == strcmp(arguments[0], "connect")){ 
-      format_terminal_for_new_entry(1);
-      Serial.print("Initiating connecitons\n\r");
-      format_new_terminal_entry();
-      return CONNECT;
-    }
+inline PacketType command_connect(char ** arguments, uint8_t num_args, terminalParameters_t & terminalParameters){
+  format_terminal_for_new_entry(1);
+  consolePrint("Initiating connecitons\n\r");
+  format_new_terminal_entry();
+  return CONNECT;
+}
 
-    else if (0 == strcmp(arguments[0], "disconnect")){ 
-      return DISCONNECT;
-    }
+inline PacketType command_disconnect(char ** arguments, uint8_t num_args, terminalParameters_t & terminalParameters){
+  return DISCONNECT;
+}
 
-    else if (0 == strcmp(arguments[0], "init")){ 
-      format_terminal_for_new_entry(1);
-      Serial.print("Re-initializing\n\r");
-      format_new_terminal_entry();
-      return INITIALIZAITON;
-    }
+inline PacketType command_init(char ** arguments, uint8_t num_args, terminalParameters_t & terminalParameters){
+  format_terminal_for_new_entry(1);
+  consolePrint("Re-initializing\n\r");
+  format_new_terminal_entry();
+  return INITIALIZAITON;
+}
 
-    else if (0 == strcmp(arguments[0], "help")){ 
-      format_terminal_for_new_entry(1);
-      Serial.print("Valid options are: clear and scan.\n\r");
-      format_new_terminal_entry();
-    }
+PacketType command_help(char ** arguments, uint8_t num_args, terminalParameters_t & terminalParameters);
 
-    else if (0 == strcmp(arguments[0], "ping")){ 
-      format_terminal_for_new_entry(1);
-      Serial.print("Starting ping\n\r");
-      format_new_terminal_entry();
-      return PING;
-    }
+inline PacketType command_ping(char ** arguments, uint8_t num_args, terminalParameters_t & terminalParameters){
+  format_terminal_for_new_entry(1);
+  consolePrint("Starting ping\n\r");
+  format_new_terminal_entry();
+  return PING;
+}
 
-    else if (0 == strcmp(arguments[0], "scan")){ 
-      format_terminal_for_new_entry(1);
-      Serial.print("Scan starting\n\r");
-      format_new_terminal_entry();
-      return SCAN;
-    }
+inline PacketType command_scan(char ** arguments, uint8_t num_args, terminalParameters_t & terminalParameters){
+  if (num_args == 2 && 0 == strcmp(arguments[1], "list")) printBleScanCache();
+  else if (num_args == 2 && 0 == strcmp(arguments[1], "stop")) bleScanStop();
+  else if (num_args == 2 && 0 == strcmp(arguments[1], "clear")) bleScanClear();
+  else if (num_args == 2 && 0 == strcmp(arguments[1], "heap")) printBleScanHeap();
+  else if (num_args == 2 && 0 == strcmp(arguments[1], "release")){
+    bleScanCache.releaseController = true;
+    consolePrint("BLE's controller memory is released the next time BLE goes down, scanning then needs a reset\n\r");
+    bleScanRequestRelease();
+  }
+  else {
+    uint32_t seconds = (num_args == 2) ? atoi(arguments[1]) : BLE_SCAN_DEFAULT_SECONDS;
+    if (seconds == 0) consolePrint("Scan time must be at least a second\n\r");
+    else if (bleScanCache.controllerReleased) consolePrint("BLE's controller memory was released, scanning needs a reset\n\r");
+    else if (!bleScanStart(seconds)) consolePrint("A scan is already running\n\r");
+    else consolePrintf("Scanning for %u s in the background\n\r", seconds);
+  }
+  return NONE;
+}
 
-    else if (0 == strcmp(arguments[0], "select")){ 
-      if (num_args < 2) Serial.print("Incorrect number of arguments for select command");
-      else {
+inline PacketType command_select(char ** arguments, uint8_t num_args, terminalParameters_t & terminalParameters){
+  terminalParameters.scanIdx = atoi(arguments[1]);
+  if (!bleScanSelect(terminalParameters.scanIdx)) consolePrint("No such device, see scan list\n\r");
+  else consolePrintf("Selected %s\n\r", bleScanCache.selectedName[0] ? bleScanCache.selectedName : "(unnamed device)");
+  return NONE;
+}
 
-        terminalParameters.scanIdx = atoi(arguments[1]);
-        format_terminal_for_new_entry(1);
-        Serial.print("Selected\n\r");
-        format_new_terminal_entry();
-        return SCAN;
+inline PacketType command_power(char ** arguments, uint8_t num_args, terminalParameters_t & terminalParameters){
+  if (num_args == 2 && 0 == strcmp(arguments[1], "reset")) powerResetStats();
+  else if (num_args == 3 && 0 == strcmp(arguments[1], "sleep") && 0 == strcmp(arguments[2], "on")){
+    if (!powerAllowSleep(true)) consolePrint("Light sleep isn't available in this SDK build (needs tickless idle)\n\r");
+  }
+  else if (num_args == 3 && 0 == strcmp(arguments[1], "sleep") && 0 == strcmp(arguments[2], "off")) powerAllowSleep(false);
+  else if (num_args > 1) consolePrint("Usage: power [reset | sleep on|off]\n\r");
+  else printPower();
+  return NONE;
+}
 
-      }
-    }
-    
-    else if (0 == strcmp(arguments[0], "stream")){ 
-      return STREAM;
-    }
-    
-    else if (0 == strcmp(arguments[0], "test")){ 
-      return TEST;
+inline PacketType command_boot(char ** arguments, uint8_t num_args, terminalParameters_t & terminalParameters){
+  printBootReport();
+  return NONE;
+}
+
+inline PacketType command_persist(char ** arguments, uint8_t num_args, terminalParameters_t & terminalParameters){
+  if (num_args == 2 && 0 == strcmp(arguments[1], "clear")){
+    fastReconnectClear();
+    consolePrint("Saved state cleared, the ring will need connect after the next boot\n\r");
+  }
+  else printFastReconnect();
+  return NONE;
+}
+
+inline PacketType command_slaves(char ** arguments, uint8_t num_args, terminalParameters_t & terminalParameters){
+  slaveTable_t table;
+  if (num_args >= 2 && 0 == strcmp(arguments[1], "bench")) benchEnumeration((num_args == 3) ? constrain(atoi(arguments[2]), 1, MAX_SLAVES) : MAX_SLAVES);
+  else if (num_args >= 2) consolePrint("Usage: slaves [bench [nodes]]\n\r");
+  else {
+    slaveTableCopy(slaveTable, table);
+    printSlaveTable(table);
+  }
+  return NONE;
+}
+
+inline PacketType command_route(char ** arguments, uint8_t num_args, terminalParameters_t & terminalParameters){
+  slaveTable_t table;
+  if (num_args < 3){
+    slaveTableCopy(slaveTable, table);
+    printRoutingTable(routingTable, table);
+  }
+  else {
+    int idx = slaveIndex(atoi(arguments[1]));
+    int mask = -1;
+    if (0 == strcmp(arguments[2], "none")) mask = 0;
+    else if (0 == strcmp(arguments[2], "left")) mask = CHANNEL_LEFT;
+    else if (0 == strcmp(arguments[2], "right")) mask = CHANNEL_RIGHT;
+    else if (0 == strcmp(arguments[2], "both")) mask = CHANNEL_BOTH;
+    if (idx < 0) consolePrint("Invalid slave address\n\r");
+    else if (mask < 0) consolePrint("Channel must be none, left, right or both\n\r");
+    else routingTable.channelMask[idx] = mask;
+  }
+  return NONE;
+}
+
+inline PacketType command_credits(char ** arguments, uint8_t num_args, terminalParameters_t & terminalParameters){
+  slaveTable_t table;
+  slaveTableCopy(slaveTable, table);
+  printFlowControl(flowControl, table);
+  return NONE;
+}
+
+inline PacketType command_buffer(char ** arguments, uint8_t num_args, terminalParameters_t & terminalParameters){
+  if (num_args >= 3 && 0 == strcmp(arguments[1], "policy")){
+    if (0 == strcmp(arguments[2], "oldest")) streamBuffer.policy = DROP_OLDEST;
+    else if (0 == strcmp(arguments[2], "newest")) streamBuffer.policy = DROP_NEWEST;
+    else if (0 == strcmp(arguments[2], "decimate")) streamBuffer.policy = DECIMATE;
+    else consolePrint("Policy must be oldest, newest or decimate\n\r");
+  }
+  else if (num_args >= 3 && 0 == strcmp(arguments[1], "capacity")){
+    size_t capacity = atoi(arguments[2]);
+    if (capacity < streamBuffer.highWatermark) consolePrint("Capacity can't be below the high watermark\n\r");
+    else streamBuffer.capacity = capacity;
+  }
+  else if (num_args >= 4 && 0 == strcmp(arguments[1], "watermarks")){
+    size_t high = atoi(arguments[2]);
+    size_t low = atoi(arguments[3]);
+    if (low >= high || high > streamBuffer.capacity) consolePrint("Watermarks must satisfy low < high <= capacity\n\r");
+    else {
+      streamBuffer.highWatermark = high;
+      streamBuffer.lowWatermark = low;
     }
+  }
+  printStreamBuffer(streamBuffer, internalNetworkStack.dataBuffer.size());
+  return NONE;
+}
+
+inline PacketType command_state(char ** arguments, uint8_t num_args, terminalParameters_t & terminalParameters){
+  if (num_args >= 3 && 0 == strcmp(arguments[1], "prebuffer")) streamController.prebufferDepth = atoi(arguments[2]);
+  printStreamController(streamController);
+  return NONE;
+}
 
-    else if (0 == strcmp(arguments[0], "clear")){
-      Serial.print("\033[H");
-      Serial.printf("\33[2J");      
+inline PacketType command_stats(char ** arguments, uint8_t num_args, terminalParameters_t & terminalParameters){
+  if (num_args >= 2 && 0 == strcmp(arguments[1], "reset")) metricsReset();
+  else printMetrics(num_args >= 2 && 0 == strcmp(arguments[1], "csv"));
+  return NONE;
+}
+
+inline PacketType command_trace(char ** arguments, uint8_t num_args, terminalParameters_t & terminalParameters){
+  if (num_args < 2 || 0 == strcmp(arguments[1], "dump")) traceDump();
+  else if (0 == strcmp(arguments[1], "start")) traceRing.enabled = true;
+  else if (0 == strcmp(arguments[1], "stop")) traceRing.enabled = false;
+  else if (0 == strcmp(arguments[1], "clear")) traceClear();
+  else consolePrint("Usage: trace [dump|start|stop|clear]\n\r");
+  return NONE;
+}
+
+inline PacketType command_latency(char ** arguments, uint8_t num_args, terminalParameters_t & terminalParameters){
+  if (num_args >= 2 && 0 == strcmp(arguments[1], "reset")) latencyResetHistograms(latencyTracker);
+  else {
+    slaveTable_t table;
+    slaveTableCopy(slaveTable, table);
+    printLatency(latencyTracker, table, num_args >= 2 && 0 == strcmp(arguments[1], "csv"));
+  }
+  return NONE;
+}
+
+inline PacketType command_mem(char ** arguments, uint8_t num_args, terminalParameters_t & terminalParameters){
+  if (num_args >= 2 && 0 == strcmp(arguments[1], "test")){
+    consolePrintf("%d check(s) failed\n\r", memorySelfTest());
+    return NONE;
+  }
+  if (num_args >= 2 && 0 == strcmp(arguments[1], "reset")) memoryResetPeaks();
+  printMemoryProfile();
+  return NONE;
+}
+
+inline PacketType command_payload(char ** arguments, uint8_t num_args, terminalParameters_t & terminalParameters){
+  consolePrintf("%d check(s) failed\n\r", payloadSelfTest());
+  return NONE;
+}
+
+inline PacketType command_handlers(char ** arguments, uint8_t num_args, terminalParameters_t & terminalParameters){
+  if (num_args >= 2 && 0 == strcmp(arguments[1], "reset")) packetDispatchResetStats();
+  printPacketDispatch();
+  return NONE;
+}
+
+inline PacketType command_console(char ** arguments, uint8_t num_args, terminalParameters_t & terminalParameters){
+  if (num_args >= 3 && 0 == strcmp(arguments[1], "policy")){
+    if (0 == strcmp(arguments[2], "oldest")) console.policy = CONSOLE_DROP_OLDEST;
+    else if (0 == strcmp(arguments[2], "newest")) console.policy = CONSOLE_DROP_NEWEST;
+    else consolePrint("Policy must be oldest or newest\n\r");
+  }
+  consolePrintf("Console overflow policy: drop %s, %u byte(s) dropped\n\r", (console.policy == CONSOLE_DROP_OLDEST) ? "oldest" : "newest", console.droppedBytes.load(std::memory_order_relaxed));
+  return NONE;
+}
+
+inline PacketType command_jobs(char ** arguments, uint8_t num_args, terminalParameters_t & terminalParameters){
+  printJobs();
+  return NONE;
+}
+
+inline PacketType command_kill(char ** arguments, uint8_t num_args, terminalParameters_t & terminalParameters){
+  if (!jobKill(atoi(arguments[1]))) consolePrintf("No queued or running job %s\n\r", arguments[1]);
+  return NONE;
+}
+
+inline PacketType command_bench(char ** arguments, uint8_t num_args, terminalParameters_t & terminalParameters){
+  if (num_args >= 2 && 0 == strcmp(arguments[1], "results")) printBenchResults(false);
+  else if (num_args >= 2 && 0 == strcmp(arguments[1], "csv")) printBenchResults(true);
+  else if (num_args >= 2 && benchRunning()) consolePrint("A benchmark is queued or running, kill it first\n\r");
+  else if (num_args >= 3 && 0 == strcmp(arguments[1], "add")){
+    if (0 == strcmp(arguments[2], "bench")) consolePrint("Scripts can't run bench commands\n\r");
+    else if (!benchAddLine(arguments + 2, num_args - 2)) consolePrint("Script is full or the command is too long\n\r");
+  }
+  else if (num_args >= 2 && 0 == strcmp(arguments[1], "clear")) benchScript.numLines = 0;
+  else if (num_args >= 3 && 0 == strcmp(arguments[1], "run")){
+    benchScript.repeats = constrain(atoi(arguments[2]), 1, BENCH_MAX_REPEATS);
+    benchScript.sweeping = (num_args >= 6);
+    if (benchScript.sweeping){
+      benchScript.sweepFrom = atoi(arguments[3]);
+      benchScript.sweepTo = atoi(arguments[4]);
+      benchScript.sweepStep = atoi(arguments[5]);
     }
-    
-    else{
-      format_terminal_for_new_entry(1);
-      Serial.print("Invalid entry. Type help to find out what options are available.\n\r");
-      format_new_terminal_entry();
+    if (benchScript.numLines == 0) consolePrint("Script is empty\n\r");
+    else if (benchScript.sweeping && (benchScript.sweepStep <= 0 || benchScript.sweepTo < benchScript.sweepFrom)) consolePrint("Sweep needs from <= to and a positive step\n\r");
+    else {
+      int id = jobSubmit("bench", benchJob);
+      benchScript.jobId = id;
+      if (id < 0) consolePrint("Too many jobs queued or running\n\r");
+      else consolePrintf("Started job %d (bench)\n\r", id);
     }
+  }
+  else printBenchScript();
+  return NONE;
+}
 
-    return NONE;
+inline PacketType command_stream(char ** arguments, uint8_t num_args, terminalParameters_t & terminalParameters){
+  return STREAM;
 }
 
+inline PacketType command_test(char ** arguments, uint8_t num_args, terminalParameters_t & terminalParameters){
+  return TEST;
+}
+
+inline PacketType command_blast(char ** arguments, uint8_t num_args, terminalParameters_t & terminalParameters){
+  bool local = (num_args >= 2 && 0 == strcmp(arguments[1], "local"));
+  int countArg = local ? 2 : 1;
+  terminalParameters.blastCount = (num_args > countArg) ? constrain(atoi(arguments[countArg]), 1, PACKET_BLAST_MAX_COUNT) : PACKET_BLAST_DEFAULT_COUNT;
+  int id = local ? jobSubmit("blast local", packetLoopbackJob) : jobSubmit("blast", packetBlastJob);
+  if (id < 0) consolePrint("Too many jobs queued or running\n\r");
+  else consolePrintf("Started job %d (%s)\n\r", id, local ? "blast local" : "blast");
+  return NONE;
+}
+
+inline PacketType command_clear(char ** arguments, uint8_t num_args, terminalParameters_t & terminalParameters){
+  consolePrint("\033[H");
+  consolePrintf("\33[2J");
+  return NONE;
+}
+
+//Every terminal command. Adding one here is all it takes: lookup is a hash probe, so it doesn't slow down the others.
+const terminalCommand_t terminalCommands[] = {
+  COMMAND("connect", 1, 1, "connect", "connect every enumerated slave", command_connect),
+  COMMAND("disconnect", 1, 1, "disconnect", "disconnect slave 1", command_disconnect),
+  COMMAND("init", 1, 1, "init", "re-enumerate the ring", command_init),
+  COMMAND("help", 1, 2, "help [command]", "list commands, or show one in detail", command_help),
+  COMMAND("ping", 1, 1, "ping", "ping the ring", command_ping),
+  COMMAND("scan", 1, 2, "scan [seconds | list | stop | clear | heap | release]", "scan for BLE devices in the background, or show what was heard", command_scan),
+  COMMAND("select", 2, 2, "select <n>", "pick a device from scan list (connect then uses its name)", command_select),
+  COMMAND("power", 1, 3, "power [reset | sleep on|off]", "show duty cycle and wakeups, or allow light sleep while idle", command_power),
+  COMMAND("boot", 1, 1, "boot", "show how long each start-up step took and which core ran it", command_boot),
+  COMMAND("persist", 1, 2, "persist [clear]", "show the state restored at boot and boot to audio time, or forget the state", command_persist),
+  COMMAND("slaves", 1, 3, "slaves [bench [nodes]]", "show the slave table, or time enumerating rings of up to 32 slaves and the packager's per-burst copy of the table", command_slaves),
+  COMMAND("route", 1, 3, "route [addr none|left|right|both]", "show or set a slave's channels", command_route),
+  COMMAND("credits", 1, 1, "credits", "show data plane flow control credits", command_credits),
+  COMMAND("buffer", 1, 4, "buffer [policy oldest|newest|decimate | capacity n | watermarks high low]", "show or configure the stream buffer", command_buffer),
+  COMMAND("state", 1, 3, "state [prebuffer n]", "show the stream state or set the prebuffer depth", command_state),
+  COMMAND("stats", 1, 2, "stats [csv|reset]", "show or reset metrics", command_stats),
+  COMMAND("trace", 1, 2, "trace [dump|start|stop|clear]", "control span tracing", command_trace),
+  COMMAND("latency", 1, 2, "latency [csv|reset]", "show or reset end-to-end latency", command_latency),
+  COMMAND("mem", 1, 2, "mem [reset | test]", "show heap and stack usage, or check the allocation hooks", command_mem),
+  COMMAND("payload", 1, 1, "payload", "check the payload structs round trip and time them against byte-at-a-time packing", command_payload),
+  COMMAND("handlers", 1, 2, "handlers [reset]", "show packet handler stats", command_handlers),
+  COMMAND("console", 1, 3, "console [policy oldest|newest]", "show or set the console overflow policy", command_console),
+  COMMAND("jobs", 1, 1, "jobs", "list background jobs and their progress", command_jobs),
+  COMMAND("kill", 2, 2, "kill <id>", "stop a background job", command_kill),
+  COMMAND("bench", 1, MAX_ARGS, "bench [add <command> | clear | run <n> [from to step] | results | csv]", "time a script of commands up to the point their packets are queued (not the slaves' replies), $ in a command is the sweep value", command_bench),
+  COMMAND("stream", 1, 1, "stream", "stream a 40 kB test pattern (background job)", command_stream),
+  COMMAND("test", 1, 1, "test", "stream the sample audio (background job)", command_test),
+  COMMAND("blast", 1, 3, "blast [local] [count]", "send pings back to back and count the responses, or with local, loop packets through the intake and reception tasks and check none are lost (background job)", command_blast),
+  COMMAND("clear", 1, 1, "clear", "clear the screen", command_clear),
+};
+
+const size_t numTerminalCommands = sizeof(terminalCommands) / sizeof(terminalCommands[0]);
+static_assert(sizeof(terminalCommands) / sizeof(terminalCommands[0]) * 2 <= COMMAND_INDEX_SIZE, "COMMAND_INDEX_SIZE is too small for the command table");
+static_assert(sizeof(terminalCommands) / sizeof(terminalCommands[0]) < NO_COMMAND, "too many commands for an 8 bit index");
+
+//Name: build_command_index
+//Purpose: fill the hash index used to look up commands (open addressing, linear probing). Must run before any input is handled.
+//Inputs: None
+//Outputs: None
+inline void build_command_index(){
+  memset(commandIndex, NO_COMMAND, sizeof(commandIndex));
+  for (size_t idx = 0; idx < numTerminalCommands; idx++){
+    uint32_t bucket = terminalCommands[idx].hash & (COMMAND_INDEX_SIZE - 1);
+    while (commandIndex[bucket] != NO_COMMAND) bucket = (bucket + 1) & (COMMAND_INDEX_SIZE - 1);
+    commandIndex[bucket] = idx;
+  }
+}
+
+//Name: find_command
+//Purpose: look up a command by name.
+//Inputs: name (C string)
+//Outputs: the command, or NULL if there's no such command
+inline const terminalCommand_t * find_command(const char * name){
+  uint32_t hash = commandHash(name);
+  uint32_t bucket = hash & (COMMAND_INDEX_SIZE - 1);
+  while (commandIndex[bucket] != NO_COMMAND){
+    const terminalCommand_t & command = terminalCommands[commandIndex[bucket]];
+    if (command.hash == hash && 0 == strcmp(command.name, name)) return &command;
+    bucket = (bucket + 1) & (COMMAND_INDEX_SIZE - 1);
+  }
+  return NULL;
+}
+
+//Name: command_help
+//Purpose: print every command from the command table, or the details of one
+//Inputs: arguments, num_args, terminalParameters (same as every command handler)
+//Outputs: NONE
+PacketType command_help(char ** arguments, uint8_t num_args, terminalParameters_t & terminalParameters){
+  if (num_args >= 2){
+    const terminalCommand_t * command = find_command(arguments[1]);
+    if (command == NULL) consolePrintf("No command named %s\n\r", arguments[1]);
+    else consolePrintf("Usage: %s\n\r  %s\n\r", command->usage, command->help);
+    return NONE;
+  }
+  for (size_t idx = 0; idx < numTerminalCommands; idx++){
+    consolePrintf("%-10s %s\n\r", terminalCommands[idx].name, terminalCommands[idx].help);
+  }
+  return NONE;
+}
 
 //Name: handle_input
 //Purpose: handle the user's input.
-//Inputs: user_input (C string containing the user input)
+//Inputs: user_input (C string containing the user input, split in place)
 //Outputs: action (enum corresponding to action to be performed)
 PacketType handle_input(char * user_input, terminalParameters_t & terminalParameters){
-    
-    const char delimiter[2] = " ";
+
     char * arguments[MAX_ARGS];
-    size_t arg_num = 0; 
-
-    //It seems as though I ran into a legitimate compiler bug as the conditional in the block below legitimately doesn't get evaluated correctly. 
-    //Print statements tell me that arg_num is 8, but it thinks arg_num is also less than 4. Either program memory is being overwritten, 
-    //or I've run into some edgecase. Compiling this snippet using repl tokenizes correctly, and the conditional is evaluated
-    //correctly.
-
-    // while(arg_num < 4){ //parse arguments
-    //     if (arguments[arg_num] == NULL){
-    //         Serial.printf("No additional arguments found...");
-    //         break;
-    //     }
-    //     arguments[arg_num++] = strtok(NULL, delimiter);
-    //     Serial.printf("Argument %d is %s [Sanity Check = %d]", arg_num, arguments[arg_num], arg_num<4);
-    // }
-    
-    //I spent over an hour banging my head against a wall, so instead
-    //I'm just gonna call strtok four times, and check for null pointers
-    //that way we don't access memory we're not supposed to. 
-    arguments[arg_num++] = strtok(user_input, delimiter);    
-    arguments[arg_num++] = strtok(NULL, delimiter);
-    arguments[arg_num++] = strtok(NULL, delimiter);
-    arguments[arg_num] = strtok(NULL, delimiter); 
-    
     uint8_t num_args = 0;
-    if (arguments[arg_num--] != NULL) num_args++;
-    if (arguments[arg_num--] != NULL) num_args++;
-    if (arguments[arg_num--] != NULL) num_args++;
-    if (arguments[arg_num] != NULL) num_args++;
+    char * pos = user_input;
+
+    //Split on spaces in place, so each argument points straight into the input buffer
+    while (*pos != '\0' && num_args < MAX_ARGS){
+      while (*pos == ' ') *pos++ = '\0';
+      if (*pos == '\0') break;
+      arguments[num_args++] = pos;
+      while (*pos != ' ' && *pos != '\0') pos++;
+    }
 
-    return argument_mapping(arguments, num_args, terminalParameters);
+    if (num_args == 0) return NONE;
 
-}
\ No newline at end of file
+    const terminalCommand_t * command = find_command(arguments[0]);
+    if (command == NULL){
+      format_terminal_for_new_entry(1);
+      consolePrint("Invalid entry. Type help to find out what options are available.\n\r");
+      format_new_terminal_entry();
+      return NONE;
+    }
+    if (num_args < command->minArgs || num_args > command->maxArgs){
+      consolePrintf("Usage: %s\n\r", command->usage);
+      return NONE;
+    }
+    return command->handler(arguments, num_args, terminalParameters);
+
+}
@@ -0,0 +1,138 @@
+#ifndef TRACING_H
+#define TRACING_H
+
+#include <Arduino.h>
+#include <atomic>
+#include "console.h"
+#if defined(ESP32)
+#include <esp_timer.h>
+#else
+#include <time.h>
+#endif
+
+#ifndef TRACING_ENABLED
+#define TRACING_ENABLED (1) //set to 0 to compile every TRACE_SPAN out
+#endif
+
+#define TRACE_RING_SIZE (512) //most recent spans kept (power of 2)
+#define TRACE_MAX_THREADS (24) //task/core pairs named in one dump
+
+typedef struct {
+  const char * name; //string literal naming the stage
+  uint32_t start; //traceTime() at the start of the span
+  uint32_t duration; //microseconds spent in the span
+  void * task; //task the span ran in
+  uint8_t core;
+} traceEvent_t;
+
+typedef struct {
+  traceEvent_t events[TRACE_RING_SIZE];
+  std::atomic<uint32_t> writePos;
+  volatile bool enabled;
+} traceRing_t;
+
+extern traceRing_t traceRing;
+
+/*  Reads a microsecond clock shared by both cores. CCOUNT isn't used since each core has its own and DFS changes its rate.
+*
+*/
+inline uint32_t IRAM_ATTR traceTime(){
+#if defined(ESP32)
+  return (uint32_t) esp_timer_get_time();
+#else
+  timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint32_t) (now.tv_sec * 1000000ULL + now.tv_nsec / 1000);
+#endif
+}
+
+/*  Records a finished span, overwriting the oldest one once the ring is full
+*
+*   @name - stage name (string literal)
+*   @start - traceTime() when the span started
+*/
+inline void IRAM_ATTR traceRecord(const char * name, uint32_t start){
+  if (!traceRing.enabled) return;
+  uint32_t end = traceTime();
+  traceEvent_t & event = traceRing.events[traceRing.writePos.fetch_add(1, std::memory_order_relaxed) & (TRACE_RING_SIZE - 1)];
+  event.name = name;
+  event.start = start;
+  event.duration = end - start;
+  event.task = xTaskGetCurrentTaskHandle();
+  event.core = xPortGetCoreID();
+}
+
+/*  Times the enclosing scope and records it as a span when the scope exits
+*
+*/
+class traceSpan {
+  public:
+    inline traceSpan(const char * name) : name(name), start(traceTime()) {}
+    inline ~traceSpan() { traceRecord(name, start); }
+  private:
+    const char * name;
+    uint32_t start;
+};
+
+#if TRACING_ENABLED
+#define TRACE_CONCAT_(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_(a, b)
+#define TRACE_SPAN(name) traceSpan TRACE_CONCAT(traceSpan_, __LINE__)(name)
+#else
+#define TRACE_SPAN(name) do {} while (0)
+#endif
+
+/*  Discards every recorded span
+*
+*/
+inline void traceClear(){
+  bool wasEnabled = traceRing.enabled;
+  traceRing.enabled = false;
+  memset(traceRing.events, 0, sizeof(traceRing.events));
+  traceRing.writePos.store(0, std::memory_order_relaxed);
+  traceRing.enabled = wasEnabled;
+}
+
+/*  Prints the recorded spans as Chrome trace event JSON (load it in chrome://tracing or ui.perfetto.dev).
+*   Tracing is paused while dumping so the ring isn't overwritten underneath the dump. Cores map to pids and task handles to
+*   numeric tids, with a thread_name record giving each task's name.
+*
+*/
+inline void traceDump(){
+  bool wasEnabled = traceRing.enabled;
+  traceRing.enabled = false;
+
+  uint32_t end = traceRing.writePos.load(std::memory_order_relaxed);
+  uint32_t begin = (end > TRACE_RING_SIZE) ? end - TRACE_RING_SIZE : 0;
+  const traceEvent_t * named[TRACE_MAX_THREADS]; //first span seen for each task/core pair
+  int numNamed = 0;
+  uint32_t origin = traceRing.events[begin & (TRACE_RING_SIZE - 1)].start;
+  bool first = true;
+
+  for (uint32_t pos = begin; pos < end; pos++){ //spans are stored in the order they finished, so find the earliest start
+    const traceEvent_t & event = traceRing.events[pos & (TRACE_RING_SIZE - 1)];
+    if (event.name != NULL && (int32_t) (event.start - origin) < 0) origin = event.start;
+  }
+
+  consolePrint("{\"traceEvents\":[\n\r");
+  for (uint32_t pos = begin; pos < end; pos++){
+    const traceEvent_t & event = traceRing.events[pos & (TRACE_RING_SIZE - 1)];
+    if (event.name == NULL) continue;
+    bool known = false;
+    for (int idx = 0; idx < numNamed && !known; idx++) known = (named[idx]->task == event.task && named[idx]->core == event.core);
+    if (!known && numNamed < TRACE_MAX_THREADS){
+      named[numNamed++] = &event;
+      consolePrintf("%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%u,\"args\":{\"name\":\"%s\"}}\n\r", first ? "" : ",",
+        event.core, (uint32_t) (uintptr_t) event.task, pcTaskGetName((TaskHandle_t) event.task));
+      first = false;
+    }
+    consolePrintf("%s{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%u,\"ts\":%u,\"dur\":%u}\n\r", first ? "" : ",",
+      event.name, event.core, (uint32_t) (uintptr_t) event.task, event.start - origin, event.duration);
+    first = false;
+  }
+  consolePrint("]}\n\r");
+
+  traceRing.enabled = wasEnabled;
+}
+
+#endif
\ No newline at end of file